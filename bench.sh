@@ -0,0 +1,85 @@
+#!/bin/bash
+
+# Compare the storage backends of klogger: the same messages are written
+# to a channel of each backend, by one writer and then by one writer per
+# CPU, and read back. Run as a user allowed to sudo, from the source tree.
+
+YELLOW='\033[1;33m'
+NC='\033[0m' # No Color
+
+MESSAGES=${MESSAGES:-200000}
+WRITERS=${WRITERS:-$(nproc)}
+QUOTA=${QUOTA:-4M}
+BACKENDS=${BACKENDS:-"ring relay trace"}
+DEBUGFS=/sys/kernel/debug/klogger
+
+print_header() {
+    echo -e "\n${YELLOW}=== $1 ===${NC}"
+}
+
+# Write MESSAGES messages to a device from each of $2 processes, print msgs/s
+WRITE='
+import os, sys, time
+dev, writers, count = sys.argv[1], int(sys.argv[2]), int(sys.argv[3])
+msg = b"<6>bench " + b"x" * 90 + b"\n"
+start = time.perf_counter()
+pids = []
+for w in range(writers):
+    pid = os.fork()
+    if not pid:
+        fd = os.open(dev, os.O_WRONLY)
+        for i in range(count // writers):
+            os.write(fd, msg)
+        os._exit(0)
+    pids.append(pid)
+for pid in pids:
+    os.waitpid(pid, 0)
+print("%.0f" % (count / (time.perf_counter() - start)))
+'
+
+# Read files until empty, print msgs/s; counting messages rather than bytes
+# keeps the relay record framing and the ring slot size out of the figure
+READ='
+import os, sys, time
+total = 0
+start = time.perf_counter()
+for path in sys.argv[1:]:
+    fd = os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+    while True:
+        try:
+            data = os.read(fd, 1 << 20)
+        except BlockingIOError:
+            break
+        if not data:
+            break
+        total += data.count(b"bench ")
+    os.close(fd)
+print("%.0f" % (total / (time.perf_counter() - start)))
+'
+
+print_header "Building module"
+make >/dev/null || exit 1
+
+CHANNELS=""
+for backend in $BACKENDS; do
+    CHANNELS="$CHANNELS${CHANNELS:+,}$backend:$QUOTA:$backend"
+done
+
+printf "\n%-8s %16s %16s %12s\n" "backend" "1 writer msg/s" "$WRITERS writers msg/s" "read msg/s"
+for backend in $BACKENDS; do
+    make unload >/dev/null
+    make load CHANNELS="$CHANNELS" >/dev/null || exit 1
+    # Relay buffers are read from debugfs, the others from the device
+    if [ "$backend" = "relay" ]; then
+        FILES=$(sudo sh -c "ls $DEBUGFS/$backend[0-9]*")
+    else
+        FILES="/dev/klogger-$backend"
+    fi
+
+    ONE=$(python3 -c "$WRITE" "/dev/klogger-$backend" 1 "$MESSAGES")
+    MANY=$(python3 -c "$WRITE" "/dev/klogger-$backend" "$WRITERS" "$MESSAGES")
+    READ_MSGS=$(sudo python3 -c "$READ" $FILES)
+    printf "%-8s %16s %16s %12s\n" "$backend" "$ONE" "$MANY" "$READ_MSGS"
+done
+
+make unload >/dev/null
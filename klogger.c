@@ -1,9 +1,10 @@
 /*
 * klogger.c - A simple kernel-space circular buffer logger
 *
-* This module implements a character device driver that provides a circular buffer
-* for logging messages in kernel space. It supports concurrent access through
-* read-write locks and maintains a fixed-size buffer of messages.
+* This module implements a character device driver that provides circular buffers
+* for logging messages in kernel space, one per channel. Writers are serialized
+* by a spinlock per channel while readers run lockless, and each channel
+* maintains a fixed-size buffer of messages split in segments.
 */
 
 #include <linux/module.h>
@@ -15,13 +16,106 @@
 #include <linux/string.h>
 #include <linux/device.h>
 #include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ctype.h>
+#include <linux/kern_levels.h>
+#include <linux/timekeeping.h>
+#include <linux/time.h>
+#include <linux/fs_context.h>
+#include <linux/wait.h>
+#include <linux/kref.h>
+#include <linux/eventfd.h>
+#include <linux/poll.h>
+#include <linux/bitops.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/cgroup.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+#include <linux/workqueue.h>
+#include <linux/shrinker.h>
+#include <linux/reboot.h>
+#include <linux/io.h>
+#include <linux/crc32.h>
+#include <linux/relay.h>
+#include <linux/debugfs.h>
+#include <linux/ring_buffer.h>
+#include <linux/cpumask.h>
+#include <linux/irq_work.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+
+#include "klogger.h"
+#include "klogger_park.h"
 
 /* Device configuration */
 #define DEVICE_NAME "klogger"    /* Name of the device in /dev */
+#define MUX_NAME "klogger-mux"   /* Name of the device merging every channel */
+#define MUX_MINOR KLOG_MAX_CHANNELS  /* Minor of the mux device, after the channels */
 #define CLASS_NAME "klogger"     /* Name of the device class */
-#define LOG_BUF_LEN (1 << 18)    /* Total buffer size (32 bytes) */
+#define PROC_DIR_NAME "klogger"  /* Name of the channel directory in /proc */
+#define KLOGFS_NAME "klogfs"     /* Name of the pseudo-filesystem */
+#define KLOGFS_MAGIC 0x6b6c6f67  /* "klog" */
+#define KLOGFS_LATEST 50         /* Number of messages in the "latest" file */
+#define LOG_BUF_LEN (1 << 18)    /* Default buffer size of a channel */
+#define LOG_BUF_MIN (2 * KLOG_SEG_SIZE)  /* Smallest buffer a channel quota allows */
+#define LOG_BUF_MAX (1 << 26)        /* Largest buffer a channel quota allows */
 #define MSG_LEN 256               /* Maximum length of each message */
-#define MAX_ENTRIES (LOG_BUF_LEN / MSG_LEN)  /* Maximum number of messages in buffer */
+#define KLOG_SEG_SIZE (64 * 1024)  /* Bytes of messages in a segment */
+#define KLOG_SEG_ENTRIES (KLOG_SEG_SIZE / MSG_LEN)  /* Messages in a segment */
+#define KLOG_SEG_SPAN 4            /* Table entries per segment a buffer may hold, room for compacted history */
+#define SLOT_BUSY U64_MAX          /* Slot stamp while a write is in progress */
+#define KLOG_HDR_PURGED 0x1        /* The message was deleted by KLOG_IOC_PURGE */
+#define KLOG_MAX_WRITERS 128       /* Writers accounted per channel in fair share mode */
+#define KLOG_NO_WRITER U16_MAX     /* Writer of a message that is not accounted */
+#define KLOG_MIXED_WRITER (U16_MAX - 1)  /* Writer of a segment holding several writers' messages */
+#define KLOG_MAX_BURST 64          /* Largest multiple of its quota a channel may grow to */
+#define KLOG_IMPORT_CHUNK (256 * 1024)  /* Bytes of a dump copied in at a time */
+#define KLOG_SHRINK_MS 1000  /* Period of the overflow release when retire_ms is 0 */
+#define KLOG_IMPORT_BATCH 64  /* Records restored between two wake-ups of readers */
+#define KLOG_PARK_VERSION 2        /* Layout of parked buffers, bump with struct klog_seg or klog_park_meta */
+#define KLOG_RELAY_SUBBUFS 8       /* Sub-buffers per CPU of a relay channel */
+#define KLOG_PERSIST_MAGIC 0x6b6c6f6770657273ULL  /* "klogpers", buffers saved in reserved memory */
+#define KLOG_BPF_STAGE 64          /* Messages from BPF programs a CPU holds until they are drained */
+
+/* Longest a writer waits for a retaining consumer before dropping its retention */
+static unsigned int retain_ms = 5000;
+module_param(retain_ms, uint, 0644);
+MODULE_PARM_DESC(retain_ms, "Maximum time in ms a writer is held back by a stalled retaining consumer");
+
+/* How long a channel stays unwritten before the segments it is not using are freed */
+static unsigned int retire_ms = 10000;
+module_param(retire_ms, uint, 0444);
+MODULE_PARM_DESC(retire_ms, "Time in ms a channel must go unwritten before its unused segments are freed, 0 to keep them");
+
+/* How far a channel may grow past its quota while consumers are behind */
+static unsigned int burst = 4;
+module_param(burst, uint, 0444);
+MODULE_PARM_DESC(burst, "Hard cap of a channel buffer as a power of two multiple of its quota, up to 64, 1 to never grow");
+
+/* Memory reserved at boot, e.g. with memmap=, to keep the buffers across kexec */
+static unsigned long persist_addr;
+module_param(persist_addr, ulong, 0444);
+MODULE_PARM_DESC(persist_addr, "Physical address of reserved memory keeping the buffers across kexec, 0 to disable");
+
+static unsigned long persist_size;
+module_param(persist_size, ulong, 0444);
+MODULE_PARM_DESC(persist_size, "Size in bytes of the reserved memory at persist_addr");
+
+/* How the buffer is shared between writers, one of KLOG_FAIR_* */
+static unsigned int fair_share = KLOG_FAIR_OFF;
+module_param(fair_share, uint, 0444);
+MODULE_PARM_DESC(fair_share, "Share each buffer between writers by weight: 0 off, 1 per process, 2 per cgroup");
+
+/* Extra channels, each with its own buffer, device, /proc file and klogfs directory */
+static char *channels = "";
+module_param(channels, charp, 0444);
+MODULE_PARM_DESC(channels, "Comma separated names of channels to create besides the default one");
 
 /* Module metadata */
 MODULE_LICENSE("GPL");
@@ -29,65 +123,585 @@ MODULE_AUTHOR("Lionel Silva");
 MODULE_DESCRIPTION("Kernel-space Logger");
 MODULE_VERSION("0.1");
 
+/**
+ * struct klog_hdr - Metadata kept next to each message slot
+ * @seq: Sequence number of the message in the slot, SLOT_BUSY while being written
+ * @gseq: Global sequence number, ordering the message against every channel
+ * @ts_ns: Wall clock time of the write in ns, never older than the previous message
+ * @level: Syslog severity taken from a leading "<N>" prefix, LOGLEVEL_INFO if none
+ * @flags: KLOG_HDR_* flags
+ * @writer: Index of the writer in the channel writers table, or KLOG_NO_WRITER
+ * @pid: Thread group id of the writer, in the initial pid namespace
+ */
+struct klog_hdr {
+    u64 seq;
+    u64 gseq;
+    u64 ts_ns;
+    u8 level;
+    u8 flags;
+    u16 writer;
+    u32 pid;
+};
+
+/**
+ * struct klog_writer - Share of a channel held by one writer in fair share mode
+ * @id: Thread group id or cgroup id of the writer, depending on fair_share
+ * @weight: Weight set with KLOG_IOC_WEIGHT, 0 for KLOG_WEIGHT_DEFAULT
+ * @count: Number of messages of the writer in the buffer
+ * @purge_seq: Sequence number before which the writer has no message left to purge
+ *
+ * An entry is free when it has neither messages nor a weight.
+ */
+struct klog_writer {
+    u64 id;
+    u32 weight;
+    u32 count;
+    u64 purge_seq;
+};
+
+/**
+ * struct klog_seg - Fixed-size piece of a channel buffer
+ * @ref: One reference for the channel's segment table, one per snapshot pinning it
+ * @rcu: Defers freeing until lockless readers are done
+ * @base: Sequence number of the first message of the segment
+ * @first_ts: Wall clock time of the first message in ns
+ * @last_ts: Wall clock time of the newest message in ns
+ * @count: Number of messages written to the segment
+ * @nr_purged: Number of those messages deleted by KLOG_IOC_PURGE
+ * @span: Number of entries of the channel's segment table pointing to the segment
+ * @compact: Built by compaction, @hdr and @data are packed rather than indexed by seq
+ * @writer: Writer of every message of the segment, KLOG_MIXED_WRITER if several
+ * @hdr: Header of each slot, its seq stamp guards the slot against readers
+ * @data: Message slots, MSG_LEN bytes each
+ *
+ * Segments are filled in sequence order and evicted whole. A segment pinned
+ * by a snapshot is never written over; the channel moves on to a fresh one.
+ * Compaction packs the messages left in several segments into one, which
+ * then takes the place of all of them in the table, in sequence order.
+ */
+struct klog_seg {
+    struct kref ref;
+    struct rcu_head rcu;
+    u64 base;
+    u64 first_ts;
+    u64 last_ts;
+    u32 count;
+    u32 nr_purged;
+    u32 span;
+    bool compact;
+    u16 writer;
+    struct klog_hdr hdr[KLOG_SEG_ENTRIES];
+    char data[KLOG_SEG_SIZE];
+};
+
+/**
+ * struct klog_channel - One circular buffer with its device and readers
+ * @segs: Ring of segments indexed by segment number, NULL when not in use, RCU protected
+ * @nr_segs: Number of entries in @segs, the hard cap of the buffer in sequence span
+ * @spare: Segment allocated ahead for the next write that needs a new one, or NULL
+ * @nr_alloc: Number of segments in @segs and @spare, for the shrinker
+ * @nr_live: Number of distinct segments between first_seq and head_seq
+ * @nr_entries: Number of message slots the channel quota allows, a power of two
+ * @max_entries: Number of message slots the buffer may grow to during a burst
+ * @first_seq: Sequence number of the oldest message, always at a segment start
+ * @head_seq: Sequence number of the next message to be written
+ * @last_ts: Wall clock time of the newest message in ns
+ * @lock: Serializes writers; readers never take it
+ * @writing: A writer holds a global sequence number it has not published yet
+ * @entries: Current number of valid entries in the buffer
+ * @device: Pointer to the device structure
+ * @groups: Named consumers and consumer groups, RCU protected
+ * @groups_lock: Serializes changes to @groups and to group retention
+ * @nr_groups: Number of entries in @groups
+ * @retainers: Number of groups with retention enabled
+ * @retain_wait: Writers waiting for retaining consumers to catch up
+ * @notifiers: Files with an eventfd or a pressure trigger, RCU protected
+ * @notifiers_lock: Serializes changes to @notifiers
+ * @poll_wait: Files waiting in poll() for messages or pressure events
+ * @writers: Writers with messages in the buffer or a weight, in fair share mode
+ * @weight_sum: Sum of the weights of the writers with messages in the buffer
+ * @retire_seq: head_seq seen by the last retire pass, to tell idle channels
+ * @compact_work: Packs the segments left sparse by KLOG_IOC_PURGE
+ * @backend: Storage the messages of the channel are kept in
+ * @relay: Per-CPU relay buffers of a relay channel
+ * @trace: Per-CPU tracing ring buffer of a trace channel
+ * @trace_lock: Serializes the readers of @trace
+ * @rec_seq: Next sequence number of a relay or trace channel
+ * @nr_purges: Number of messages ever purged, which invalidates klogfs sizes
+ * @idx: Index of the channel in klog.channels, also its device minor
+ * @name: Name of the channel in /proc/klogger and klogfs
+ */
+struct klog_channel {
+    struct klog_seg __rcu **segs;
+    u32 nr_segs;
+    struct klog_seg *spare;
+    u32 nr_alloc;
+    u32 nr_live;
+    u32 nr_entries;
+    u32 max_entries;
+    u64 first_seq;
+    u64 head_seq;
+    u64 last_ts;
+    spinlock_t lock;
+    bool writing;
+    atomic_t entries;
+    struct device *device;
+    struct list_head groups;
+    struct mutex groups_lock;
+    unsigned int nr_groups;
+    atomic_t retainers;
+    wait_queue_head_t retain_wait;
+    struct list_head notifiers;
+    struct mutex notifiers_lock;
+    wait_queue_head_t poll_wait;
+    struct klog_writer writers[KLOG_MAX_WRITERS];
+    u32 weight_sum;
+    u64 retire_seq;
+    struct work_struct compact_work;
+    const struct klog_backend *backend;
+    union {
+        struct rchan *relay;
+        struct trace_buffer *trace;
+    };
+    struct mutex trace_lock;
+    atomic64_t rec_seq;
+    u64 nr_purges;
+    unsigned int idx;
+    char name[KLOG_CHANNEL_NAME_LEN];
+};
+
+/**
+ * struct klog_backend - Storage behind a channel
+ * @name: Name of the backend in the channels parameter
+ * @open: Allocate the storage of a new channel for a quota in bytes
+ * @close: Free the storage of a channel nothing uses any more
+ * @write: Store a message; the text is less than MSG_LEN bytes
+ * @read: Read messages from the device, or NULL to read the ring
+ *
+ * The ring backend is the segmented ring the rest of the module is built
+ * around: only its channels have sequence numbers to seek to, snapshots,
+ * consumers, fair share and the ioctls. The other backends only take writes
+ * and hand the messages to their own readers.
+ */
+struct klog_backend {
+    const char *name;
+    int (*open)(struct klog_channel *ch, size_t quota);
+    void (*close)(struct klog_channel *ch);
+    int (*write)(struct klog_channel *ch, struct file *filep, const char *msg, size_t len,
+                 struct klog_hdr *tmpl);
+    ssize_t (*read)(struct klog_channel *ch, struct kiocb *iocb, struct iov_iter *to);
+};
+
+/**
+ * struct klog_bpf_msg - Message written by a BPF program, waiting to be drained
+ * @ts_ns: Wall clock time of the write in ns
+ * @channel: Index of the channel the message goes to
+ * @pid: Process the program ran in the context of
+ * @len: Length of @text
+ * @text: NUL-terminated message text
+ */
+struct klog_bpf_msg {
+    u64 ts_ns;
+    u32 channel;
+    pid_t pid;
+    u16 len;
+    char text[MSG_LEN];
+};
+
+/**
+ * struct klog_bpf_stage - Messages written by BPF programs on one CPU
+ * @head: Count of messages staged, advanced by bpf_klog_write() with interrupts off
+ * @tail: Count of messages drained, advanced by @work
+ * @irq_work: Schedules @work from whatever context the program ran in
+ * @work: Writes the staged messages to their channels
+ * @msgs: Staged messages, indexed by count modulo KLOG_BPF_STAGE
+ *
+ * There is one producer, the CPU the stage belongs to, and one consumer,
+ * @work, so the counts are the only synchronization needed.
+ */
+struct klog_bpf_stage {
+    u32 head;
+    u32 tail;
+    struct irq_work irq_work;
+    struct work_struct work;
+    struct klog_bpf_msg msgs[KLOG_BPF_STAGE];
+} ____cacheline_aligned;
+
 /**
  * struct klogger - Main data structure for the kernel logger
- * @log_buffer: Circular buffer to store messages
- * @head: Index where next write will occur
- * @tail: Index where next read will start
- * @prev_head: Previous head position for read operations
- * @rwlock: Read-write lock for thread safety
+ * @channels: Channels in the order they were created, the default one first
+ * @nr_channels: Number of entries in @channels
+ * @gseq: Next global sequence number, shared by every channel
  * @open_count: Number of processes currently using the device
- * @entries: Current number of valid entries in the buffer
  * @device_class: Pointer to the device class
- * @device: Pointer to the device structure
+ * @mux_device: Device reading every channel merged in global order
+ * @proc_dir: Directory holding one /proc file per channel
+ * @persist: Reserved memory the buffers are saved to on reboot, or NULL
+ * @debugfs_dir: Directory holding the files of the relay channels
+ * @bpf: Staging of the messages written by BPF programs, one per possible CPU, or NULL
  * @major_number: Major number assigned to the device
  */
 struct klogger {
-    char log_buffer[LOG_BUF_LEN];
-    size_t head;
-    size_t tail;
-    size_t prev_head;
-    rwlock_t rwlock;
+    struct klog_channel *channels[KLOG_MAX_CHANNELS];
+    unsigned int nr_channels;
+    atomic64_t gseq;
     atomic_t open_count;
-    atomic_t entries;
     struct class *device_class;
-    struct device *device;
+    struct device *mux_device;
+    struct proc_dir_entry *proc_dir;
+    struct klog_persist_hdr *persist;
+    struct dentry *debugfs_dir;
+    struct klog_bpf_stage *bpf;
     int major_number;
 } klog_t;
 
+/**
+ * struct klog_snap - Frozen view of the buffer taken by KLOG_IOC_SNAPSHOT
+ * @rcu: Defers freeing until lockless readers of the file are done
+ * @first: Sequence number of the oldest message in the snapshot
+ * @head: Sequence number one past the newest message in the snapshot
+ * @nr_segs: Number of entries in @segs
+ * @segs: Pinned segments holding the messages from @first to @head, oldest first
+ */
+struct klog_snap {
+    struct rcu_head rcu;
+    u64 first;
+    u64 head;
+    unsigned int nr_segs;
+    struct klog_seg *segs[];
+};
+
+/**
+ * struct klog_park_channel - State of one channel handed to the next load
+ * @name: Name of the channel, which it is matched by
+ * @first_seq: Sequence number of the oldest message
+ * @head_seq: Sequence number of the next message to be written
+ * @last_ts: Wall clock time of the newest message in ns
+ * @weight_sum: Sum of the weights of the writers with messages in the buffer
+ * @nr_slots: Number of table entries from @first_seq up to @head_seq
+ * @slot: Index in klog_park_meta.slots of the block of the first entry
+ * @writers: Fair share accounting of the messages in the buffer
+ */
+struct klog_park_channel {
+    char name[KLOG_CHANNEL_NAME_LEN];
+    u64 first_seq;
+    u64 head_seq;
+    u64 last_ts;
+    u32 weight_sum;
+    u32 nr_slots;
+    u32 slot;
+    struct klog_writer writers[KLOG_MAX_WRITERS];
+};
+
+/**
+ * struct klog_park_meta - Description of parked buffers
+ * @gseq: Next global sequence number
+ * @seg_size: Size of struct klog_seg, a safety net against a missed version bump
+ * @nr_channels: Number of entries in @channels
+ * @channels: Channels that had messages
+ * @slots: Block of each table entry of each channel, in sequence order
+ *
+ * A compacted segment fills several consecutive entries with the same block.
+ */
+struct klog_park_meta {
+    u64 gseq;
+    u32 seg_size;
+    u32 nr_channels;
+    struct klog_park_channel channels[KLOG_MAX_CHANNELS];
+    u32 slots[];
+};
+
+/**
+ * struct klog_persist_hdr - Start of the reserved memory holding saved buffers
+ * @magic: KLOG_PERSIST_MAGIC once the rest is complete, 0 otherwise
+ * @version: KLOG_PARK_VERSION of the module that saved the buffers
+ * @crc: CRC32 of the meta data and of the blocks
+ * @nr_blocks: Number of segments saved
+ * @meta_size: Size of the struct klog_park_meta following the header
+ * @len: Bytes used after the header
+ *
+ * The segments follow the meta data, cache line aligned, one struct
+ * klog_seg each.
+ */
+struct klog_persist_hdr {
+    u64 magic;
+    u32 version;
+    u32 crc;
+    u32 nr_blocks;
+    u32 meta_size;
+    u64 len;
+};
+
+/**
+ * struct klog_seq_iter - Iterator state of a /proc channel file
+ * @ch: Channel of the file
+ * @seq: Sequence number of the current message
+ * @len: Length of the current message
+ * @msg: Copy of the current message
+ */
+struct klog_seq_iter {
+    struct klog_channel *ch;
+    u64 seq;
+    ssize_t len;
+    char msg[MSG_LEN];
+};
+
+/* Kinds of file in a klogfs channel directory */
+enum klogfs_kind {
+    KLOGFS_LATEST_FILE,     /* Newest KLOGFS_LATEST messages */
+    KLOGFS_ERRORS_FILE,     /* Messages of severity LOGLEVEL_ERR or worse */
+    KLOGFS_SLICE_FILE,      /* Messages written during one minute */
+};
+
+/* Directory positions of the klogfs channel files, slices follow by minute */
+#define KLOGFS_POS_LATEST 2
+#define KLOGFS_POS_ERRORS 3
+#define KLOGFS_POS_SLICES 4
+
+/* The view of a klogfs file packs its minute, channel index and kind */
+#define KLOGFS_VIEW(minute, idx, kind) (((unsigned long)(minute) << 6) | ((idx) << 2) | (kind))
+#define KLOGFS_VIEW_KIND(view) ((view) & 3)
+#define KLOGFS_VIEW_CHANNEL(view) (((view) >> 2) & 15)
+#define KLOGFS_VIEW_MINUTE(view) ((view) >> 6)
+
+/* Length of a slice name such as "2026-10-15T12:03", with its NUL */
+#define KLOGFS_SLICE_NAME_LEN 17
+
+/**
+ * struct klogfs_node - The i_private of a klogfs file
+ * @view: Minute, channel index and kind of the file, see KLOGFS_VIEW()
+ * @lock: Serializes updates of the cached size
+ * @start: Sequence number @size is counted from
+ * @end: Sequence number @size is counted up to
+ * @nr_purges: nr_purges of the channel when @size was counted
+ * @size: Bytes the messages from @start to @end read as
+ */
+struct klogfs_node {
+    unsigned long view;
+    struct mutex lock;
+    u64 start;
+    u64 end;
+    u64 nr_purges;
+    loff_t size;
+};
+
+/**
+ * struct klogfs_mark - Point a klogfs read can resume from
+ * @seq: Sequence number of the next message to look at
+ * @pos: Byte offset in the file where the message at @seq starts
+ */
+struct klogfs_mark {
+    u64 seq;
+    loff_t pos;
+};
+
+/**
+ * struct klogfs_cursor - Per open file state of a klogfs file
+ * @ch: Channel the file shows
+ * @lock: Serializes reads sharing the cursor
+ * @kind: Which messages the file shows
+ * @start: Sequence number of the first message of the file
+ * @end: Sequence number one past the last message of the file
+ * @seq: Sequence number of the next message to look at
+ * @pos: Byte offset in the file where the message at @seq starts
+ * @marks: Where the cursor was as it first went past each segment start
+ * @nr_marks: Number of entries of @marks filled in
+ * @max_marks: Number of entries of @marks
+ */
+struct klogfs_cursor {
+    struct klog_channel *ch;
+    struct mutex lock;
+    enum klogfs_kind kind;
+    u64 start;
+    u64 end;
+    u64 seq;
+    loff_t pos;
+    struct klogfs_mark *marks;
+    unsigned int nr_marks;
+    unsigned int max_marks;
+};
+
+/**
+ * struct klog_group - Consumer group sharing one read position
+ * @node: Entry in the groups of its channel
+ * @ref: One reference for the channel's list, one per member and per read in progress
+ * @rcu: Defers freeing until lockless walkers of the list are done
+ * @pos: Sequence number of the next message to hand out to the group
+ * @wait: Members blocked waiting for messages, woken one at a time
+ * @retain: Writers must not overwrite messages at or after @pos
+ * @name: Name of the group
+ *
+ * A group is also a named consumer offset: it stays in the list after its
+ * last member leaves, so a restarted reader resumes where the group stopped.
+ */
+struct klog_group {
+    struct list_head node;
+    struct kref ref;
+    struct rcu_head rcu;
+    atomic64_t pos;
+    wait_queue_head_t wait;
+    bool retain;
+    char name[KLOG_GROUP_NAME_LEN];
+};
+
+/**
+ * struct klog_file - Per open file state
+ * @ch: Channel the file was opened on
+ * @lock: Serializes snapshot and group changes on this file
+ * @snap: Snapshot being read instead of the live buffer, or NULL
+ * @group: Consumer group this file reads for, or NULL
+ * @read_seq: Read position of this file, as left by the last read or seek
+ * @notify_node: Entry in the channel's notifiers while an eventfd or a pressure trigger is set
+ * @notify_ctx: eventfd signalled when @notify_mark unread messages are pending
+ * @notify_mark: Watermark of unread messages
+ * @notify_armed: Cleared when the eventfd is signalled, set again by the next read
+ * @pressure_lag: Unread messages that trigger a pressure event, 0 if unused
+ * @pressure_pct: Fill percentage of the buffer that triggers a pressure event, 0 if unused
+ * @pressure_above: The file is currently above one of its pressure thresholds
+ * @pressure_event: A crossing has not been reported by poll() yet
+ */
+struct klog_file {
+    struct klog_channel *ch;
+    struct mutex lock;
+    struct klog_snap __rcu *snap;
+    struct klog_group __rcu *group;
+    u64 read_seq;
+    struct list_head notify_node;
+    struct eventfd_ctx *notify_ctx;
+    u32 notify_mark;
+    bool notify_armed;
+    u64 pressure_lag;
+    u32 pressure_pct;
+    bool pressure_above;
+    bool pressure_event;
+};
+
+/**
+ * struct klog_mux_src - Merge state of one channel in a mux reader
+ * @seq: Sequence number of the next message wanted from the channel
+ * @len: Length of the message held in @msg, negative if none is held
+ * @hdr: Header of the message held in @msg
+ * @msg: Next message of the channel, waiting for its turn in the merge
+ */
+struct klog_mux_src {
+    u64 seq;
+    ssize_t len;
+    struct klog_hdr hdr;
+    char msg[MSG_LEN];
+};
+
+/**
+ * struct klog_mux - Per open file state of the mux device
+ * @lock: Serializes reads and subscription changes sharing the merge state
+ * @subs: Bitmap of the channels read, indexed like klog.channels
+ * @narrowed: @subs was set by KLOG_IOC_MUX_SUBSCRIBE rather than left at all channels
+ * @records: Reads return struct klog_record headers rather than plain text
+ * @gseq: Global sequence number one past the last message read
+ * @src: Merge state of each channel, indexed like klog.channels
+ */
+struct klog_mux {
+    struct mutex lock;
+    unsigned long subs;
+    bool narrowed;
+    bool records;
+    u64 gseq;
+    struct klog_mux_src src[KLOG_MAX_CHANNELS];
+};
+
 /* Global instance of the logger */
 static struct klogger klog;
 
 /* Function prototypes */
 static int dev_open(struct inode *inodep, struct file *filep);
 static int dev_release(struct inode *inodep, struct file *filep);
-static ssize_t dev_read(struct file *filep, char __user *user_buffer, size_t count, loff_t *file_pos);
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to);
 static ssize_t dev_write(struct file *filep, const char __user *user_buffer, size_t count, loff_t *file_pos);
+static loff_t dev_llseek(struct file *filep, loff_t offset, int whence);
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
+static __poll_t dev_poll(struct file *filep, poll_table *wait);
+static void klog_group_leave(struct klog_file *kf);
+static void klog_notify_unregister(struct klog_file *kf);
+static void klog_snap_free(struct klog_snap *snap);
+static int mux_open(struct inode *inodep, struct file *filep);
+static int mux_release(struct inode *inodep, struct file *filep);
+static ssize_t mux_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static __poll_t mux_poll(struct file *filep, poll_table *wait);
+static long mux_ioctl(struct file *filep, unsigned int cmd, unsigned long arg);
+static const struct klog_backend klog_ring_backend;
+static void klog_adopt_pending(struct klog_channel *ch);
 
 /* File operations structure */
 static struct file_operations fops = {
     .owner = THIS_MODULE,
     .open = dev_open,
-    .read = dev_read,
+    .read_iter = dev_read_iter,
     .write = dev_write,
+    .llseek = dev_llseek,
+    .poll = dev_poll,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
     .release = dev_release,
 };
 
+/* File operations of the mux device, installed by dev_open() */
+static const struct file_operations mux_fops = {
+    .owner = THIS_MODULE,
+    .open = mux_open,
+    .read_iter = mux_read_iter,
+    .poll = mux_poll,
+    .unlocked_ioctl = mux_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .release = mux_release,
+};
+
+/**
+ * klog_is_ring() - Tell whether a channel keeps its messages in the ring
+ * @ch: Channel
+ *
+ * Return: true for a ring channel
+ */
+static inline bool klog_is_ring(const struct klog_channel *ch) {
+    return ch->backend == &klog_ring_backend;
+}
+
 /**
  * dev_open() - Called when a process opens the device
  * @inodep: Pointer to the inode object
  * @filep: Pointer to the file object
  *
- * Increments the open_count to track number of processes using the device.
+ * Increments the open_count to track number of processes using the device
+ * and allocates the per file state. The minor selects the channel; the mux
+ * minor switches the file over to mux_fops.
  *
  * Return: 0 on success, negative error code on failure
  */
 static int dev_open(struct inode *inodep, struct file *filep) {
+    unsigned int minor = iminor(inodep);
+    struct klog_file *kf;
+
     // Check for potential overflow before incrementing
     if (atomic_read(&klog.open_count) == INT_MAX) {
         printk(KERN_ERR "klogger: Too many open handles\n");
         return -EMFILE;
     }
+
+    if (minor == MUX_MINOR) {
+        replace_fops(filep, &mux_fops);
+        return filep->f_op->open(inodep, filep);
+    }
+    if (minor >= klog.nr_channels) {
+        return -ENODEV;
+    }
+
+    kf = kzalloc(sizeof(*kf), GFP_KERNEL_ACCOUNT);
+    if (!kf) {
+        return -ENOMEM;
+    }
+    kf->ch = klog.channels[minor];
+    mutex_init(&kf->lock);
+    INIT_LIST_HEAD(&kf->notify_node);
+    filep->private_data = kf;
+
     atomic_inc(&klog.open_count);
     return 0;
 }
@@ -97,11 +711,20 @@ static int dev_open(struct inode *inodep, struct file *filep) {
  * @inodep: Pointer to the inode object
  * @filep: Pointer to the file object
  *
- * Decrements the open_count when a process is done with the device.
+ * Decrements the open_count when a process is done with the device
+ * and frees the per file state.
  *
  * Return: 0 on success, negative error code on failure
  */
 static int dev_release(struct inode *inodep, struct file *filep) {
+    struct klog_file *kf = filep->private_data;
+
+    // Nothing can be reading through this file any more
+    klog_snap_free(rcu_dereference_protected(kf->snap, 1));
+    klog_notify_unregister(kf);
+    klog_group_leave(kf);
+    kfree(kf);
+
     // Check for underflow before decrementing
     if (atomic_read(&klog.open_count) <= 0) {
         printk(KERN_WARNING "klogger: Device close called but no open handles\n");
@@ -112,223 +735,5484 @@ static int dev_release(struct inode *inodep, struct file *filep) {
 }
 
 /**
- * dev_read() - Read messages from the circular buffer
- * @filep: Pointer to the file object
- * @user_buffer: Buffer in user space to store read data
- * @count: Number of bytes to read
- * @file_pos: Current position in file
+ * klog_segno() - Get the segment number of a message
+ * @seq: Sequence number of the message
  *
- * Reads messages from the circular buffer starting at the tail position.
- * Uses read lock to ensure thread safety during read operations.
+ * Return: Number of the segment the message is stored in
+ */
+static inline u64 klog_segno(u64 seq) {
+    return seq / KLOG_SEG_ENTRIES;
+}
+
+/**
+ * klog_seg_off() - Get the slot of a message within its segment
+ * @seq: Sequence number of the message
  *
- * Return: Number of bytes read, or negative error code on failure
+ * Return: Index of the slot holding the message
  */
-static ssize_t dev_read(struct file *filep, char __user *user_buffer, size_t count, loff_t *file_pos) {
-    size_t bytes_read = 0;
-    size_t bytes_to_copy;
-    size_t current_pos = klog.tail;
-    size_t entries_read = 0;
-    char *buffer;
+static inline unsigned int klog_seg_off(u64 seq) {
+    return seq & (KLOG_SEG_ENTRIES - 1);
+}
 
-    if (!user_buffer || count == 0) {
-        return -EINVAL;
-    }
+/**
+ * klog_seg_slot() - Get the entry of the segment table covering a message
+ * @ch: Channel of the message
+ * @seq: Sequence number of the message
+ *
+ * Return: Pointer to the segment table entry
+ */
+static inline struct klog_seg __rcu **klog_seg_slot(struct klog_channel *ch, u64 seq) {
+    return &ch->segs[klog_segno(seq) & (ch->nr_segs - 1)];
+}
 
-    if (*file_pos >= LOG_BUF_LEN) {
-        return 0;
-    }
+/**
+ * klog_seg_alloc() - Allocate an empty segment
+ *
+ * Every slot starts out busy, so a reader racing with the segment being
+ * put in place retries rather than reading an empty slot. The segment is
+ * charged to the memory cgroup of the caller.
+ *
+ * Return: New segment with one reference, or NULL
+ */
+static struct klog_seg *klog_seg_alloc(void) {
+    struct klog_seg *seg = kvzalloc(sizeof(*seg), GFP_KERNEL_ACCOUNT);
+    unsigned int i;
 
-    // Allocate temporary buffer - limit to count size
-    buffer = kmalloc(min_t(size_t, count, LOG_BUF_LEN), GFP_KERNEL);
-    if (!buffer) {
-        return -ENOMEM;
+    if (!seg) {
+        return NULL;
     }
+    kref_init(&seg->ref);
+    seg->writer = KLOG_NO_WRITER;
+    for (i = 0; i < KLOG_SEG_ENTRIES; i++) {
+        seg->hdr[i].seq = SLOT_BUSY;
+    }
+    return seg;
+}
 
-    read_lock(&klog.rwlock);
-    // Read until we fill the temp buffer or reach the head
-    while (bytes_read < count && entries_read < atomic_read(&klog.entries)) {
+/**
+ * klog_seg_release() - Free a segment once nothing refers to it
+ * @ref: Reference count of the segment
+ */
+static void klog_seg_release(struct kref *ref) {
+    struct klog_seg *seg = container_of(ref, struct klog_seg, ref);
 
-        // Get length of current message
-        bytes_to_copy = strnlen(klog.log_buffer + (current_pos * MSG_LEN), MSG_LEN);
-        
-        // Don't copy more than the user requested
-        if (bytes_read + bytes_to_copy > count) {
-            bytes_to_copy = count - bytes_read;
-        }
+    kvfree_rcu(seg, rcu);
+}
 
-        // Copy to temp buffer
-        memcpy(buffer + bytes_read,
-               klog.log_buffer + (current_pos * MSG_LEN),
-               bytes_to_copy);
+/**
+ * klog_seg_put() - Drop a reference to a segment
+ * @seg: Segment to release, may be NULL
+ */
+static void klog_seg_put(struct klog_seg *seg) {
+    if (seg) {
+        kref_put(&seg->ref, klog_seg_release);
+    }
+}
 
-        bytes_read += bytes_to_copy;
-        entries_read++;
+/**
+ * klog_first_seq() - Get the sequence number of the oldest message
+ * @ch: Channel of the message
+ *
+ * Return: Sequence number of the oldest message still in the buffer
+ */
+static inline u64 klog_first_seq(struct klog_channel *ch) {
+    return smp_load_acquire(&ch->first_seq);
+}
 
-        // Stop if we've reached the head
-        if (current_pos == klog.prev_head) {
-            break;
-        }
+/**
+ * klog_seg_find() - Find the first message at or after a point in a compacted segment
+ * @seg: Segment built by compaction
+ * @seq: Sequence number wanted
+ *
+ * Return: Index of the slot holding the first message numbered @seq or more,
+ * or the number of messages of @seg if there is none
+ */
+static unsigned int klog_seg_find(struct klog_seg *seg, u64 seq) {
+    unsigned int lo = 0;
+    unsigned int hi = min_t(u32, READ_ONCE(seg->count), KLOG_SEG_ENTRIES);
+    unsigned int mid;
 
-        // Move to next entry
-        current_pos = (current_pos + 1) & (MAX_ENTRIES - 1);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (READ_ONCE(seg->hdr[mid].seq) < seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
 
-    read_unlock(&klog.rwlock);
+    return lo;
+}
 
-    if (*file_pos >= bytes_to_copy) {
-        return 0;
-    }
+/**
+ * klog_ts_at() - Get the time of a message without validating it
+ * @ch: Channel of the message
+ * @seq: Sequence number of a message between first_seq and head_seq
+ *
+ * A message dropped by compaction counts as the next one left in its
+ * segment, if any.
+ *
+ * Return: Wall clock time of the message in ns, of a newer one that replaced
+ * it, 0 if its segment was evicted, or U64_MAX if compaction left nothing
+ * at or after @seq in its segment
+ */
+static u64 klog_ts_at(struct klog_channel *ch, u64 seq) {
+    struct klog_seg *seg;
+    unsigned int i;
+    u64 ts;
 
-    // Now copy all data to user space at once
-    if (copy_to_user(user_buffer, buffer, bytes_read)) {
-        kfree(buffer);
-        return -EFAULT;
+    rcu_read_lock();
+    seg = rcu_dereference(*klog_seg_slot(ch, seq));
+    if (!seg) {
+        ts = 0;
+    } else if (READ_ONCE(seg->compact)) {
+        i = klog_seg_find(seg, seq);
+        ts = i < READ_ONCE(seg->count) ? READ_ONCE(seg->hdr[i].ts_ns) : U64_MAX;
+    } else {
+        ts = READ_ONCE(seg->hdr[klog_seg_off(seq)].ts_ns);
     }
+    rcu_read_unlock();
 
-    // Free the temporary buffer
-    kfree(buffer);
-
-    // Update file position with actual bytes read
-    *file_pos += bytes_read;
-
-    return bytes_read;
+    return ts;
 }
 
 /**
- * dev_write() - Write a message to the circular buffer
- * @filep: Pointer to the file object
- * @user_buffer: Buffer in user space containing data to write
- * @count: Number of bytes to write
- * @file_pos: Current position in file
+ * klog_seq_at_time() - Find the first message written at or after a time
+ * @ch: Channel to search
+ * @ts_ns: Wall clock time in ns
  *
- * Writes a message to the circular buffer at the head position.
- * If buffer is full, overwrites oldest message.
- * Uses write lock to ensure thread safety during write operations.
+ * Timestamps never go backwards along the sequence, so the buffer doubles as
+ * a time index. The segment headers are binary searched first for the
+ * segment whose newest message is recent enough, then the slots of that one
+ * segment, all of the entries it fills if it was compacted. Nothing is
+ * validated; a segment or slot reused during the search only carries a
+ * newer time, which at worst moves the result forward, and one evicted
+ * during the search counts as older than @ts_ns.
  *
- * Return: Number of bytes written, or negative error code on failure
+ * Return: Sequence number of the first such message, or head_seq if none
  */
-static ssize_t dev_write(struct file *filep, const char __user *user_buffer, size_t count, loff_t *file_pos) {
-    size_t bytes_to_copy = count;
-    size_t usr_idx = 0;
+static u64 klog_seq_at_time(struct klog_channel *ch, u64 ts_ns) {
+    u64 head = smp_load_acquire(&ch->head_seq);
+    u64 first = klog_first_seq(ch);
+    struct klog_seg *seg;
+    u64 lo, hi, mid;
+    u64 start, end;
+    u64 last_ts;
 
-    // If incoming data is larger than the buffer, truncate to keep only the latest part
-    if (count >= MSG_LEN) {
-        usr_idx = count - (MSG_LEN - 1);
-        bytes_to_copy = MSG_LEN - 1;
+    if (first >= head) {
+        return head;
     }
 
-    if (*file_pos >= MSG_LEN) {
-        return 0;
+    lo = klog_segno(first);
+    hi = klog_segno(head - 1);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        rcu_read_lock();
+        seg = rcu_dereference(*klog_seg_slot(ch, mid * KLOG_SEG_ENTRIES));
+        last_ts = seg ? READ_ONCE(seg->last_ts) : 0;
+        rcu_read_unlock();
+        if (last_ts < ts_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
 
-    write_lock(&klog.rwlock);
-
-    if (atomic_read(&klog.entries) == MAX_ENTRIES && klog.head == klog.tail) {
-        klog.tail = (klog.tail + 1) & (MAX_ENTRIES - 1);
+    // Every entry of a compacted segment has its last_ts, search all of them
+    start = lo * KLOG_SEG_ENTRIES;
+    end = start + KLOG_SEG_ENTRIES;
+    rcu_read_lock();
+    seg = rcu_dereference(*klog_seg_slot(ch, start));
+    if (seg && READ_ONCE(seg->compact)) {
+        start = READ_ONCE(seg->base);
+        end = start + (u64)READ_ONCE(seg->span) * KLOG_SEG_ENTRIES;
     }
+    rcu_read_unlock();
 
-    if (copy_from_user(klog.log_buffer + (klog.head * MSG_LEN), user_buffer + usr_idx, bytes_to_copy)) {
-        write_unlock(&klog.rwlock);
-        return -EFAULT;
+    hi = min(head, end);
+    lo = max(first, start);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (klog_ts_at(ch, mid) < ts_ns) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
 
-    klog.log_buffer[(klog.head * MSG_LEN) + bytes_to_copy] = '\0';
+    return lo;
+}
+
+/**
+ * klog_seg_read() - Copy the first message at or after a point out of a segment
+ * @seg: Segment covering @seq
+ * @seq: In: first sequence number wanted. Out: sequence number actually read,
+ *       or where to look next on -ENOENT
+ * @msg: Destination buffer of at least MSG_LEN bytes
+ * @hdr: If not NULL, receives the header of the message
+ *
+ * The slot is copied between two reads of its seq stamp, and the copy is
+ * only kept if the stamp did not change. Purged messages are skipped.
+ * Called under rcu_read_lock().
+ *
+ * Return: Length of the message, -ENOENT if @seg holds nothing more at
+ * @seq, or -EAGAIN if a writer got in the way
+ */
+static ssize_t klog_seg_read(struct klog_seg *seg, u64 *seq, char *msg, struct klog_hdr *hdr) {
+    struct klog_hdr *slot_hdr;
+    unsigned int i;
+    bool purged;
+    u64 found;
 
-    if (atomic_read(&klog.entries) < MAX_ENTRIES) {
-        atomic_inc(&klog.entries);
+    if (READ_ONCE(seg->compact)) {
+        i = klog_seg_find(seg, *seq);
+        if (i >= READ_ONCE(seg->count)) {
+            *seq = (klog_segno(*seq) + 1) * KLOG_SEG_ENTRIES;
+            return -ENOENT;
+        }
+        found = READ_ONCE(seg->hdr[i].seq);
+        if (found < *seq || found == SLOT_BUSY) {
+            return -EAGAIN;
+        }
+    } else {
+        i = klog_seg_off(*seq);
+        found = *seq;
     }
 
-    klog.prev_head = klog.head;
-    klog.head = (klog.head + 1) & (MAX_ENTRIES - 1);
-    
-    write_unlock(&klog.rwlock);  // Unlock after writing
+    slot_hdr = &seg->hdr[i];
+    if (smp_load_acquire(&slot_hdr->seq) != found) {
+        return -EAGAIN;
+    }
+    memcpy(msg, seg->data + i * MSG_LEN, MSG_LEN);
+    if (hdr) {
+        *hdr = *slot_hdr;
+    }
+    purged = READ_ONCE(slot_hdr->flags) & KLOG_HDR_PURGED;
+    smp_rmb();
+    if (READ_ONCE(slot_hdr->seq) != found) {
+        return -EAGAIN;
+    }
 
-    return count; // Return number of bytes written
+    if (purged) {
+        *seq = found + 1;
+        return -ENOENT;
+    }
+    *seq = found;
+    return strnlen(msg, MSG_LEN);
 }
 
 /**
- * klogger_init() - Initialize the kernel logger module
+ * klog_fetch() - Copy one message out of the circular buffer
+ * @ch: Channel to read from
+ * @seq: In: first sequence number wanted. Out: sequence number actually read
+ * @msg: Destination buffer of at least MSG_LEN bytes
+ * @hdr: If not NULL, receives the header of the message
  *
- * Initializes the circular buffer, synchronization primitives,
- * and creates the character device.
+ * If @seq has already been evicted, the oldest message still in the buffer
+ * is returned instead and @seq is moved forward to it. Purged messages are
+ * skipped the same way.
  *
- * Return: 0 on success, negative error code on failure
+ * Readers take no lock. Each slot carries the sequence number of the message
+ * it holds, and a writer stamps it SLOT_BUSY before touching the data. The
+ * slot is copied between two reads of the stamp, and the copy is only kept if
+ * the stamp matched @seq both times. Readers of different slots therefore
+ * never contend with each other, and only retry against a writer that is
+ * overwriting the very slot they are reading. Segments are RCU protected, so
+ * one swapped out of the table under a reader stays readable until it is
+ * done; the copy is only kept if the segment is still in place afterwards.
+ *
+ * Return: Length of the message, or -ENODATA if no message at or after @seq
  */
-static int __init klogger_init(void) {
+static ssize_t klog_fetch(struct klog_channel *ch, u64 *seq, char *msg, struct klog_hdr *hdr) {
+    struct klog_seg __rcu **slot;
+    struct klog_seg *seg;
+    ssize_t len;
+    u64 head;
 
-    // Initialize the device structure
-    // klog.log_buffer = kmalloc(LOG_BUF_LEN, GFP_KERNEL);
-    // if (!klog.log_buffer) {
-    //     printk(KERN_ERR "Failed to allocate ring buffer.\n");
-    //     return -ENOMEM;
-    // }
-    memset(klog.log_buffer, 0, LOG_BUF_LEN);
-    klog.head = 0;
-    klog.tail = 0;
-    klog.prev_head = 0;
+    for (;;) {
+        head = smp_load_acquire(&ch->head_seq);
+        if (*seq < klog_first_seq(ch)) {
+            *seq = klog_first_seq(ch);
+        }
+        if (*seq >= head) {
+            return -ENODATA;
+        }
 
-    // Initialize synchronization primitivesklog.log_buffer = kmalloc(LOG_BUF_LEN, GFP_KERNEL);
-    // if (!klog.log_buffer) {
-    //     printk(KERN_ERR "Failed to allocate ring buffer.\n");
-    //     return -ENOMEM;
-    // }
-    atomic_set(&klog.entries, 0);
+        slot = klog_seg_slot(ch, *seq);
+        rcu_read_lock();
+        seg = rcu_dereference(*slot);
+        len = seg ? klog_seg_read(seg, seq, msg, hdr) : -EAGAIN;
+        if (len >= 0 && rcu_dereference(*slot) != seg) {
+            len = -EAGAIN;
+        }
+        rcu_read_unlock();
 
+        if (len >= 0) {
+            return len;
+        }
+        if (len == -EAGAIN) {
+            // Overwritten under us, catch up with the writer and try again
+            cpu_relax();
+        }
+    }
+}
 
+/**
+ * klog_snap_fetch() - Copy one message out of a snapshot
+ * @snap: Snapshot to read from
+ * @seq: In: first sequence number wanted. Out: sequence number actually read
+ * @msg: Destination buffer of at least MSG_LEN bytes
+ *
+ * The segments of a snapshot are pinned and never written below its head,
+ * so no validation is needed. Messages purged since the snapshot was taken
+ * are skipped all the same.
+ *
+ * Return: Length of the message, or -ENODATA if no message at or after @seq
+ */
+static ssize_t klog_snap_fetch(struct klog_snap *snap, u64 *seq, char *msg) {
+    struct klog_seg *seg;
+    const char *p;
+    unsigned int i;
+    size_t len;
+    u64 found;
 
-    // Register major number
-    klog.major_number = register_chrdev(0, DEVICE_NAME, &fops);
-    if (klog.major_number < 0) {
-        printk(KERN_ERR "Failed to register major number\n");
-        return klog.major_number;
+    if (*seq < snap->first) {
+        *seq = snap->first;
     }
 
-    // Create device class
-    klog.device_class = class_create(CLASS_NAME);
-    if (IS_ERR(klog.device_class)) {
-        unregister_chrdev(klog.major_number, DEVICE_NAME);
-        printk(KERN_ERR "Failed to create device class\n");
-        return PTR_ERR(klog.device_class);
-    }
+    while (*seq < snap->head) {
+        seg = snap->segs[klog_segno(*seq) - klog_segno(snap->first)];
+        if (seg->compact) {
+            i = klog_seg_find(seg, *seq);
+            if (i >= seg->count) {
+                *seq = (klog_segno(*seq) + 1) * KLOG_SEG_ENTRIES;
+                continue;
+            }
+            found = seg->hdr[i].seq;
+        } else {
+            i = klog_seg_off(*seq);
+            found = *seq;
+        }
+        if (found >= snap->head) {
+            break;
+        }
+        if (READ_ONCE(seg->hdr[i].flags) & KLOG_HDR_PURGED) {
+            *seq = found + 1;
+            continue;
+        }
 
-    // Create device
-    klog.device = device_create(
-        klog.device_class, 
-        NULL, 
-        MKDEV(klog.major_number, 0), 
-        NULL, 
-        DEVICE_NAME
-    );
-    if (IS_ERR(klog.device)) {
-        class_destroy(klog.device_class);
-        unregister_chrdev(klog.major_number, DEVICE_NAME);
-        printk(KERN_ERR "Failed to create device\n");
-        return PTR_ERR(klog.device);
+        p = seg->data + i * MSG_LEN;
+        len = strnlen(p, MSG_LEN);
+        memcpy(msg, p, len);
+        *seq = found;
+        return len;
     }
 
-    printk(KERN_INFO "Klogger device registered\n");
-    
-    return 0;
+    return -ENODATA;
 }
 
 /**
- * klogger_exit() - Cleanup and unregister the kernel logger module
+ * klog_snap_free() - Free a snapshot and unpin its segments
+ * @snap: Snapshot no longer installed on any file, may be NULL
+ */
+static void klog_snap_free(struct klog_snap *snap) {
+    unsigned int i;
+
+    if (!snap) {
+        return;
+    }
+    for (i = 0; i < snap->nr_segs; i++) {
+        klog_seg_put(snap->segs[i]);
+    }
+    kvfree_rcu(snap, rcu);
+}
+
+/**
+ * klog_file_fetch() - Copy one message for a reader
+ * @kf: Per file state of the reader
+ * @seq: In: first sequence number wanted. Out: sequence number actually read
+ * @msg: Destination buffer of at least MSG_LEN bytes
  *
- * Destroys the character device, class, and frees resources.
- * Warns if there are still open handles to the device.
+ * Reads from the snapshot of @kf if it has one, or from the live buffer.
+ *
+ * Return: Length of the message, or -ENODATA if no message at or after @seq
  */
-static void __exit klogger_exit(void) {
+static ssize_t klog_file_fetch(struct klog_file *kf, u64 *seq, char *msg) {
+    struct klog_snap *snap;
+    ssize_t len;
 
-    // Free buffer
-    // kfree(klog.log_buffer);
+    rcu_read_lock();
+    snap = rcu_dereference(kf->snap);
+    len = snap ? klog_snap_fetch(snap, seq, msg) : klog_fetch(kf->ch, seq, msg, NULL);
+    rcu_read_unlock();
 
-    // if there are still handles open print a message
-    if (atomic_read(&klog.open_count) != 0) {
-        printk(KERN_WARNING "There are still %d device(s) open.\n", atomic_read(&klog.open_count));
+    return len;
+}
+
+/**
+ * klog_file_bounds() - Get the range of messages a reader can see
+ * @kf: Per file state of the reader
+ * @first: Out: sequence number of the oldest message
+ * @head: Out: sequence number one past the newest message
+ */
+static void klog_file_bounds(struct klog_file *kf, u64 *first, u64 *head) {
+    struct klog_snap *snap;
+
+    rcu_read_lock();
+    snap = rcu_dereference(kf->snap);
+    if (snap) {
+        *first = snap->first;
+        *head = snap->head;
+    } else {
+        *head = smp_load_acquire(&kf->ch->head_seq);
+        *first = klog_first_seq(kf->ch);
     }
+    rcu_read_unlock();
+}
+
+/**
+ * klog_snapshot_take() - Freeze the buffer for one reader
+ * @filep: Pointer to the file object
+ * @uinfo: User space buffer receiving the range of the snapshot
+ *
+ * Pins every segment from the oldest message up to the current head rather
+ * than copying them. Writers never write over a pinned segment, they move
+ * on to a fresh one instead, so the messages below the cut stay as they
+ * were for as long as the snapshot lives. The channel lock is only held
+ * while the segments are pinned. The file is rewound to the oldest message
+ * of the snapshot.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_snapshot_take(struct file *filep, struct klog_snapshot __user *uinfo) {
+    struct klog_file *kf = filep->private_data;
+    struct klog_channel *ch = kf->ch;
+    struct klog_snapshot info;
+    struct klog_snap *snap;
+    struct klog_snap *old;
+    struct klog_seg *seg;
+    u64 seq;
+
+    if (rcu_access_pointer(kf->group)) {
+        return -EBUSY;
+    }
+
+    snap = kvzalloc(struct_size(snap, segs, ch->nr_segs), GFP_KERNEL_ACCOUNT);
+    if (!snap) {
+        return -ENOMEM;
+    }
+
+    spin_lock(&ch->lock);
+    snap->first = ch->first_seq;
+    snap->head = ch->head_seq;
+    for (seq = snap->first; seq < snap->head; seq += KLOG_SEG_ENTRIES) {
+        seg = rcu_dereference_protected(*klog_seg_slot(ch, seq), lockdep_is_held(&ch->lock));
+        kref_get(&seg->ref);
+        snap->segs[snap->nr_segs++] = seg;
+    }
+    spin_unlock(&ch->lock);
+
+    info.first_seq = snap->first;
+    info.head_seq = snap->head;
+    if (copy_to_user(uinfo, &info, sizeof(info))) {
+        klog_snap_free(snap);
+        return -EFAULT;
+    }
+
+    mutex_lock(&kf->lock);
+    old = rcu_replace_pointer(kf->snap, snap, lockdep_is_held(&kf->lock));
+    filep->f_pos = snap->first;
+    mutex_unlock(&kf->lock);
+
+    klog_snap_free(old);
+
+    return 0;
+}
+
+/**
+ * klog_snapshot_drop() - Go back to reading the live buffer
+ * @kf: Per file state of the reader
+ */
+static void klog_snapshot_drop(struct klog_file *kf) {
+    struct klog_snap *old;
+
+    mutex_lock(&kf->lock);
+    old = rcu_replace_pointer(kf->snap, NULL, lockdep_is_held(&kf->lock));
+    mutex_unlock(&kf->lock);
+
+    klog_snap_free(old);
+}
+
+/**
+ * klog_group_free() - Free a consumer group once nothing refers to it
+ * @ref: Reference count of the group
+ */
+static void klog_group_free(struct kref *ref) {
+    struct klog_group *grp = container_of(ref, struct klog_group, ref);
+
+    kfree_rcu(grp, rcu);
+}
+
+/**
+ * klog_group_put() - Drop a reference to a consumer group
+ * @grp: Group to release, may be NULL
+ */
+static void klog_group_put(struct klog_group *grp) {
+    if (grp) {
+        kref_put(&grp->ref, klog_group_free);
+    }
+}
+
+/**
+ * klog_group_name_valid() - Check a consumer name from user space
+ * @name: Name buffer of KLOG_GROUP_NAME_LEN bytes
+ *
+ * Return: true if @name is non-empty and NUL-terminated
+ */
+static inline bool klog_group_name_valid(const char *name) {
+    return name[0] && strnlen(name, KLOG_GROUP_NAME_LEN) < KLOG_GROUP_NAME_LEN;
+}
+
+/**
+ * klog_group_lookup() - Find a consumer group by name
+ * @ch: Channel the group reads
+ * @name: Name of the group
+ * @create: Create the group if it does not exist
+ *
+ * A new group starts at the oldest message in the buffer so it sees
+ * everything still available. Called with the channel groups_lock held; the
+ * group stays valid until it is dropped.
+ *
+ * Return: The group, or an error pointer
+ */
+static struct klog_group *klog_group_lookup(struct klog_channel *ch, const char *name, bool create) {
+    struct klog_group *grp;
+
+    list_for_each_entry(grp, &ch->groups, node) {
+        if (!strcmp(grp->name, name)) {
+            return grp;
+        }
+    }
+    if (!create) {
+        return ERR_PTR(-ENOENT);
+    }
+    if (ch->nr_groups >= KLOG_MAX_GROUPS) {
+        return ERR_PTR(-ENOSPC);
+    }
+
+    grp = kzalloc(sizeof(*grp), GFP_KERNEL_ACCOUNT);
+    if (!grp) {
+        return ERR_PTR(-ENOMEM);
+    }
+    kref_init(&grp->ref);
+    atomic64_set(&grp->pos, klog_first_seq(ch));
+    init_waitqueue_head(&grp->wait);
+    strscpy(grp->name, name, sizeof(grp->name));
+    list_add_tail_rcu(&grp->node, &ch->groups);
+    ch->nr_groups++;
+
+    return grp;
+}
+
+/**
+ * klog_group_set_retain() - Turn retention of a group on or off
+ * @ch: Channel the group reads
+ * @grp: Consumer group
+ * @retain: New setting
+ *
+ * Called with the channel groups_lock held.
+ */
+static void klog_group_set_retain(struct klog_channel *ch, struct klog_group *grp, bool retain) {
+    if (grp->retain == retain) {
+        return;
+    }
+    grp->retain = retain;
+    if (retain) {
+        atomic_inc(&ch->retainers);
+    } else {
+        atomic_dec(&ch->retainers);
+        wake_up_interruptible(&ch->retain_wait);
+    }
+}
+
+/**
+ * klog_group_drop() - Forget a consumer group
+ * @ch: Channel the group reads
+ * @grp: Consumer group
+ *
+ * Current members keep reading through it until they leave. Called with
+ * the channel groups_lock held.
+ */
+static void klog_group_drop(struct klog_channel *ch, struct klog_group *grp) {
+    klog_group_set_retain(ch, grp, false);
+    list_del_rcu(&grp->node);
+    ch->nr_groups--;
+    klog_group_put(grp);
+}
+
+/**
+ * klog_group_get() - Get the consumer group of a reader
+ * @kf: Per file state of the reader
+ *
+ * Return: Referenced group, or NULL if the file is not in a group
+ */
+static struct klog_group *klog_group_get(struct klog_file *kf) {
+    struct klog_group *grp;
+
+    rcu_read_lock();
+    grp = rcu_dereference(kf->group);
+    if (grp && !kref_get_unless_zero(&grp->ref)) {
+        grp = NULL;
+    }
+    rcu_read_unlock();
+
+    return grp;
+}
+
+/**
+ * klog_group_join() - Add a reader to a consumer group
+ * @kf: Per file state of the reader
+ * @ureq: User space request naming the group
+ *
+ * A group that does not exist yet is created. An existing one, even with no
+ * members left, is resumed at its saved position.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_group_join(struct klog_file *kf, struct klog_group_req __user *ureq) {
+    struct klog_channel *ch = kf->ch;
+    struct klog_group_req req;
+    struct klog_group *grp;
+    int err = 0;
+
+    if (copy_from_user(&req, ureq, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (!klog_group_name_valid(req.name)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&kf->lock);
+    if (rcu_access_pointer(kf->group) || rcu_access_pointer(kf->snap)) {
+        err = -EBUSY;
+        goto out_unlock;
+    }
+
+    mutex_lock(&ch->groups_lock);
+    grp = klog_group_lookup(ch, req.name, true);
+    if (IS_ERR(grp)) {
+        err = PTR_ERR(grp);
+    } else {
+        kref_get(&grp->ref);
+        rcu_assign_pointer(kf->group, grp);
+    }
+    mutex_unlock(&ch->groups_lock);
+
+out_unlock:
+    mutex_unlock(&kf->lock);
+    return err;
+}
+
+/**
+ * klog_group_leave() - Remove a reader from its consumer group
+ * @kf: Per file state of the reader
+ *
+ * The group keeps its position for the next reader that joins it.
+ */
+static void klog_group_leave(struct klog_file *kf) {
+    struct klog_group *grp;
+
+    mutex_lock(&kf->lock);
+    grp = rcu_replace_pointer(kf->group, NULL, lockdep_is_held(&kf->lock));
+    mutex_unlock(&kf->lock);
+
+    klog_group_put(grp);
+}
+
+/**
+ * klog_offset_ioctl() - Get, set or delete a named consumer offset
+ * @ch: Channel the offset belongs to
+ * @cmd: KLOG_IOC_OFFSET_GET, KLOG_IOC_OFFSET_SET or KLOG_IOC_OFFSET_DELETE
+ * @uoff: User space offset request
+ *
+ * Named offsets live in the module, so a consumer that restarts, or one
+ * that reads without joining, can save and restore its position.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_offset_ioctl(struct klog_channel *ch, unsigned int cmd, struct klog_offset __user *uoff) {
+    struct klog_offset off;
+    struct klog_group *grp;
+    int err = 0;
+
+    if (copy_from_user(&off, uoff, sizeof(off))) {
+        return -EFAULT;
+    }
+    if (!klog_group_name_valid(off.name) || off.pad ||
+        (off.flags & ~KLOG_OFFSET_RETAIN)) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&ch->groups_lock);
+    grp = klog_group_lookup(ch, off.name, cmd == KLOG_IOC_OFFSET_SET);
+    if (IS_ERR(grp)) {
+        err = PTR_ERR(grp);
+        goto out_unlock;
+    }
+
+    switch (cmd) {
+    case KLOG_IOC_OFFSET_GET:
+        off.seq = atomic64_read(&grp->pos);
+        off.flags = grp->retain ? KLOG_OFFSET_RETAIN : 0;
+        break;
+    case KLOG_IOC_OFFSET_SET:
+        atomic64_set(&grp->pos, off.seq);
+        klog_group_set_retain(ch, grp, off.flags & KLOG_OFFSET_RETAIN);
+        wake_up_interruptible(&ch->retain_wait);
+        break;
+    case KLOG_IOC_OFFSET_DELETE:
+        klog_group_drop(ch, grp);
+        break;
+    }
+
+out_unlock:
+    mutex_unlock(&ch->groups_lock);
+
+    if (!err && cmd == KLOG_IOC_OFFSET_GET && copy_to_user(uoff, &off, sizeof(off))) {
+        err = -EFAULT;
+    }
+    return err;
+}
+
+/**
+ * klog_consumers_behind() - Check whether a consumer has not read up to a point
+ * @ch: Channel being written to
+ * @end: Sequence number to compare with
+ *
+ * Consumers are the groups and named offsets of the channel, and the files
+ * watching it with an eventfd or a pressure trigger. Plain readers are not
+ * tracked.
+ *
+ * Return: true if a consumer is positioned before @end
+ */
+static bool klog_consumers_behind(struct klog_channel *ch, u64 end) {
+    struct klog_group *grp;
+    struct klog_file *kf;
+    bool behind = false;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(grp, &ch->groups, node) {
+        if (atomic64_read(&grp->pos) < end) {
+            behind = true;
+            goto out;
+        }
+    }
+    list_for_each_entry_rcu(kf, &ch->notifiers, notify_node) {
+        if (!rcu_access_pointer(kf->group) && READ_ONCE(kf->read_seq) < end) {
+            behind = true;
+            goto out;
+        }
+    }
+out:
+    rcu_read_unlock();
+
+    return behind;
+}
+
+/**
+ * klog_segs_used() - Count the segments a channel holds messages in
+ * @ch: Channel to look at
+ *
+ * Only the segments between first_seq and head_seq count, not what the
+ * table happens to hold, and a compacted segment counts once however many
+ * table entries it fills, so the room purged messages leave is given back
+ * to new history. May be called without the channel lock, for an estimate.
+ *
+ * Return: Number of live segments
+ */
+static inline u32 klog_segs_used(struct klog_channel *ch) {
+    return READ_ONCE(ch->nr_live);
+}
+
+/**
+ * klog_seg_span() - Get the largest sequence span the table of a channel covers
+ * @ch: Channel to look at
+ *
+ * Return: Number of sequence numbers between first_seq and head_seq at most
+ */
+static inline u64 klog_seg_span(struct klog_channel *ch) {
+    return (u64)ch->nr_segs * KLOG_SEG_ENTRIES;
+}
+
+/**
+ * klog_seg_full() - Check whether a channel holds its quota of messages
+ * @ch: Channel to look at
+ * @head: Sequence number the next write would get
+ *
+ * The buffer is full once it holds its quota in segments, or once the
+ * segment @head falls in reaches the end of the table. May be called
+ * without the channel lock, for an estimate.
+ *
+ * Return: true if the next segment opened evicts one, consumers aside
+ */
+static bool klog_seg_full(struct klog_channel *ch, u64 head) {
+    u64 first = READ_ONCE(ch->first_seq);
+
+    if (head == first) {
+        return false;
+    }
+
+    return ALIGN(head, KLOG_SEG_ENTRIES) - first >= klog_seg_span(ch) ||
+           klog_segs_used(ch) >= ch->nr_entries / KLOG_SEG_ENTRIES;
+}
+
+/**
+ * klog_seg_evicts() - Check whether a write has to evict the oldest segment
+ * @ch: Channel being written to
+ * @head: Sequence number the write would get
+ *
+ * Only a write opening a new segment evicts anything, and then it evicts
+ * the whole oldest segment. Once the buffer is full, the new segment is an
+ * overflow one instead as long as a consumer has not read the oldest
+ * segment yet, up to max_entries worth of segments. The table bounds the
+ * sequence span, which evicts regardless.
+ *
+ * Return: true if the write evicts the segment starting at first_seq
+ */
+static bool klog_seg_evicts(struct klog_channel *ch, u64 head) {
+    u64 first = READ_ONCE(ch->first_seq);
+
+    if (klog_seg_off(head) || !klog_seg_full(ch, head)) {
+        return false;
+    }
+    if (head - first >= klog_seg_span(ch) ||
+        klog_segs_used(ch) >= ch->max_entries / KLOG_SEG_ENTRIES) {
+        return true;
+    }
+
+    return !klog_consumers_behind(ch, first + KLOG_SEG_ENTRIES);
+}
+
+/**
+ * klog_retainers_behind() - Check whether a retaining group has not read up to a point
+ * @ch: Channel of the groups
+ * @end: Sequence number to compare with
+ *
+ * Return: true if a group with retention enabled is positioned before @end
+ */
+static bool klog_retainers_behind(struct klog_channel *ch, u64 end) {
+    struct klog_group *grp;
+    bool behind = false;
+
+    if (!atomic_read(&ch->retainers)) {
+        return false;
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(grp, &ch->groups, node) {
+        if (READ_ONCE(grp->retain) && atomic64_read(&grp->pos) < end) {
+            behind = true;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return behind;
+}
+
+/**
+ * klog_retain_blocked() - Check whether a write would drop retained messages
+ * @ch: Channel being written to
+ * @head: Sequence number the write would get
+ *
+ * Called with the channel lock held. Groups are only looked at when the
+ * write would evict a segment, once every KLOG_SEG_ENTRIES messages.
+ *
+ * Return: true if the segment to be evicted is still wanted by a retaining group
+ */
+static bool klog_retain_blocked(struct klog_channel *ch, u64 head) {
+    if (!klog_seg_evicts(ch, head)) {
+        return false;
+    }
+
+    return klog_retainers_behind(ch, READ_ONCE(ch->first_seq) + KLOG_SEG_ENTRIES);
+}
+
+/**
+ * klog_retain_wait() - Wait for retaining consumers to make room
+ * @ch: Channel being written to
+ * @filep: File being written to, or NULL for a writer that cannot wait
+ *
+ * Waits at most retain_ms. A consumer that has not made room by then is
+ * considered stalled and loses its retention, so a dead reader can hold
+ * writers back only once.
+ *
+ * Return: 0 when the write may go ahead, negative error code otherwise
+ */
+static int klog_retain_wait(struct klog_channel *ch, struct file *filep) {
+    struct klog_group *grp;
+    u64 end;
+    long ret;
+
+    if (!filep || filep->f_flags & O_NONBLOCK) {
+        return -EAGAIN;
+    }
+
+    ret = wait_event_interruptible_timeout(ch->retain_wait,
+                                           !klog_retain_blocked(ch, READ_ONCE(ch->head_seq)),
+                                           msecs_to_jiffies(retain_ms));
+    if (ret < 0) {
+        return ret;
+    }
+    if (ret > 0) {
+        return 0;
+    }
+
+    mutex_lock(&ch->groups_lock);
+    if (klog_seg_evicts(ch, READ_ONCE(ch->head_seq))) {
+        end = READ_ONCE(ch->first_seq) + KLOG_SEG_ENTRIES;
+        list_for_each_entry(grp, &ch->groups, node) {
+            if (grp->retain && atomic64_read(&grp->pos) < end) {
+                printk(KERN_WARNING "klogger: consumer %s stalled, no longer retaining\n", grp->name);
+                klog_group_set_retain(ch, grp, false);
+            }
+        }
+    }
+    mutex_unlock(&ch->groups_lock);
+
+    return 0;
+}
+
+/**
+ * klog_group_pending() - Check whether a group has messages to hand out
+ * @ch: Channel the group reads
+ * @grp: Consumer group
+ *
+ * Return: true if a message at or after the group position is available
+ */
+static inline bool klog_group_pending(struct klog_channel *ch, struct klog_group *grp) {
+    return atomic64_read(&grp->pos) < smp_load_acquire(&ch->head_seq);
+}
+
+/**
+ * klog_groups_wake() - Wake one waiting member of every consumer group
+ * @ch: Channel that was written to
+ *
+ * Called by writers after publishing a message. Members wait exclusively,
+ * so each group gets a single wake-up per message rather than a herd.
+ */
+static void klog_groups_wake(struct klog_channel *ch) {
+    struct klog_group *grp;
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(grp, &ch->groups, node) {
+        if (wq_has_sleeper(&grp->wait)) {
+            wake_up_interruptible(&grp->wait);
+        }
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * klog_file_lag() - Count the messages a reader has not read yet
+ * @kf: Per file state of the reader
+ * @head: Current value of head_seq
+ *
+ * Counted from the group position for group members, from the last read or
+ * seek otherwise. Called under rcu_read_lock().
+ *
+ * Return: Number of unread messages, including any already overwritten
+ */
+static u64 klog_file_lag(struct klog_file *kf, u64 head) {
+    struct klog_group *grp = rcu_dereference(kf->group);
+    u64 pos = grp ? atomic64_read(&grp->pos) : READ_ONCE(kf->read_seq);
+
+    return head > pos ? head - pos : 0;
+}
+
+/**
+ * klog_notify_check() - Fire a file's eventfd and pressure trigger if crossed
+ * @kf: Per file state of a watched file
+ * @head: Current value of head_seq
+ *
+ * The eventfd is signalled once per crossing of its watermark; further
+ * writes are coalesced until the reader reads again. A pressure event is
+ * raised when the file goes from below both thresholds to above one, and
+ * reported once by poll(). Called under rcu_read_lock().
+ */
+static void klog_notify_check(struct klog_file *kf, u64 head) {
+    struct eventfd_ctx *ctx = READ_ONCE(kf->notify_ctx);
+    u64 pressure_lag = READ_ONCE(kf->pressure_lag);
+    u32 pressure_pct = READ_ONCE(kf->pressure_pct);
+    u64 lag = klog_file_lag(kf, head);
+    bool above;
+
+    if (ctx && lag >= kf->notify_mark &&
+        READ_ONCE(kf->notify_armed) && xchg(&kf->notify_armed, false)) {
+        eventfd_signal(ctx);
+    }
+
+    if (!pressure_lag && !pressure_pct) {
+        return;
+    }
+    above = (pressure_lag && lag >= pressure_lag) ||
+            (pressure_pct && lag * 100 >= (u64)pressure_pct * kf->ch->nr_entries);
+    if (!above) {
+        WRITE_ONCE(kf->pressure_above, false);
+    } else if (!READ_ONCE(kf->pressure_above) && !xchg(&kf->pressure_above, true)) {
+        WRITE_ONCE(kf->pressure_event, true);
+        wake_up_interruptible_poll(&kf->ch->poll_wait, EPOLLPRI);
+    }
+}
+
+/**
+ * klog_notify_all() - Check every watched file after a write
+ * @ch: Channel that was written to
+ * @head: Current value of head_seq
+ */
+static void klog_notify_all(struct klog_channel *ch, u64 head) {
+    struct klog_file *kf;
+
+    if (list_empty(&ch->notifiers)) {
+        return;
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(kf, &ch->notifiers, notify_node) {
+        klog_notify_check(kf, head);
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * klog_notify_rearm() - Re-arm a file's eventfd after a read
+ * @kf: Per file state of the reader
+ *
+ * If the reader is still above its watermark it is signalled again right
+ * away, so a reader that stops early is not left waiting. Pressure that
+ * has gone away is noticed here too.
+ */
+static void klog_notify_rearm(struct klog_file *kf) {
+    if (list_empty(&kf->notify_node)) {
+        return;
+    }
+
+    WRITE_ONCE(kf->notify_armed, true);
+    rcu_read_lock();
+    klog_notify_check(kf, smp_load_acquire(&kf->ch->head_seq));
+    rcu_read_unlock();
+}
+
+/**
+ * klog_notify_update() - Add or remove a file from the watched files
+ * @kf: Per file state of the reader
+ * @old: eventfd the file no longer uses, or NULL
+ *
+ * Called with kf->lock held after changing its eventfd or pressure trigger,
+ * or when the file is being released.
+ */
+static void klog_notify_update(struct klog_file *kf, struct eventfd_ctx *old) {
+    struct klog_channel *ch = kf->ch;
+    bool watch = kf->notify_ctx || kf->pressure_lag || kf->pressure_pct;
+    bool removed = false;
+
+    mutex_lock(&ch->notifiers_lock);
+    if (watch && list_empty(&kf->notify_node)) {
+        list_add_tail_rcu(&kf->notify_node, &ch->notifiers);
+    } else if (!watch && !list_empty(&kf->notify_node)) {
+        list_del_rcu(&kf->notify_node);
+        removed = true;
+    }
+    mutex_unlock(&ch->notifiers_lock);
+
+    if (removed || old) {
+        // Writers may still be looking at the file or its old eventfd
+        synchronize_rcu();
+        if (removed) {
+            INIT_LIST_HEAD(&kf->notify_node);
+        }
+        if (old) {
+            eventfd_ctx_put(old);
+        }
+    }
+}
+
+/**
+ * klog_notify_unregister() - Stop watching a file that is being released
+ * @kf: Per file state of the reader
+ */
+static void klog_notify_unregister(struct klog_file *kf) {
+    struct eventfd_ctx *old = kf->notify_ctx;
+
+    kf->notify_ctx = NULL;
+    kf->pressure_lag = 0;
+    kf->pressure_pct = 0;
+    klog_notify_update(kf, old);
+}
+
+/**
+ * klog_notify_register() - Register or unregister an eventfd for a reader
+ * @kf: Per file state of the reader
+ * @unotify: User space registration request
+ *
+ * Lets event loops multiplexing many eventfds wait for klogger without a
+ * dedicated thread blocked in read().
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_notify_register(struct klog_file *kf, struct klog_notify __user *unotify) {
+    struct klog_notify req;
+    struct eventfd_ctx *ctx = NULL;
+    struct eventfd_ctx *old;
+
+    if (copy_from_user(&req, unotify, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.fd >= 0) {
+        ctx = eventfd_ctx_fdget(req.fd);
+        if (IS_ERR(ctx)) {
+            return PTR_ERR(ctx);
+        }
+    }
+
+    mutex_lock(&kf->lock);
+    old = kf->notify_ctx;
+    kf->notify_mark = max_t(u32, req.watermark, 1);
+    kf->notify_armed = true;
+    WRITE_ONCE(kf->notify_ctx, ctx);
+    klog_notify_update(kf, old);
+
+    // Messages may already be waiting
+    klog_notify_rearm(kf);
+    mutex_unlock(&kf->lock);
+
+    return 0;
+}
+
+/**
+ * klog_pressure_register() - Set or clear the pressure trigger of a reader
+ * @kf: Per file state of the reader
+ * @upressure: User space trigger thresholds
+ *
+ * Modeled on PSI triggers: poll() reports POLLPRI once each time the
+ * reader's unread messages cross a threshold, so a shipper can speed up
+ * before messages are overwritten rather than find out afterwards.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_pressure_register(struct klog_file *kf, struct klog_pressure __user *upressure) {
+    struct klog_pressure req;
+
+    if (copy_from_user(&req, upressure, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.fill_pct > 100 || req.pad) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&kf->lock);
+    WRITE_ONCE(kf->pressure_pct, req.fill_pct);
+    WRITE_ONCE(kf->pressure_lag, req.lag);
+    kf->pressure_above = false;
+    kf->pressure_event = false;
+    klog_notify_update(kf, NULL);
+
+    // The reader may already be above a threshold
+    klog_notify_rearm(kf);
+    mutex_unlock(&kf->lock);
+
+    return 0;
+}
+
+/**
+ * klog_writer_id() - Identify the calling writer for fair sharing
+ *
+ * Return: Thread group id or cgroup id of current, depending on fair_share
+ */
+static u64 klog_writer_id(void) {
+    u64 id;
+
+    if (fair_share != KLOG_FAIR_CGROUP) {
+        return task_tgid_nr(current);
+    }
+
+    rcu_read_lock();
+    id = cgroup_id(task_dfl_cgroup(current));
+    rcu_read_unlock();
+
+    return id;
+}
+
+/**
+ * klog_writer_weight() - Get the weight of a writer
+ * @w: Writer entry
+ *
+ * Return: Weight of the writer
+ */
+static inline u32 klog_writer_weight(struct klog_writer *w) {
+    return w->weight ?: KLOG_WEIGHT_DEFAULT;
+}
+
+/**
+ * klog_writer_find() - Find or add the entry of a writer
+ * @ch: Channel being written to
+ * @id: Writer id from klog_writer_id()
+ *
+ * The table is small and scanned from a slot picked by hashing @id, so a
+ * writer is usually found within a few entries. Called with the channel
+ * lock held.
+ *
+ * Return: Entry of the writer, or NULL if the table is full
+ */
+static struct klog_writer *klog_writer_find(struct klog_channel *ch, u64 id) {
+    unsigned int start = hash_64(id, ilog2(KLOG_MAX_WRITERS));
+    struct klog_writer *free = NULL;
+    struct klog_writer *w;
+    unsigned int n;
+
+    for (n = 0; n < KLOG_MAX_WRITERS; n++) {
+        w = &ch->writers[(start + n) & (KLOG_MAX_WRITERS - 1)];
+        if (!w->count && !w->weight) {
+            if (!free) {
+                free = w;
+            }
+        } else if (w->id == id) {
+            return w;
+        }
+    }
+
+    if (free) {
+        free->id = id;
+        free->purge_seq = 0;
+    }
+    return free;
+}
+
+/**
+ * klog_fair_over() - Check whether a writer holds more than its share
+ * @ch: Channel being written to
+ * @w: Writer entry, with messages in the buffer
+ *
+ * A writer's share of the buffer is its weight over the sum of the weights
+ * of every writer with messages in it. Shares are of the quota, overflow
+ * segments are not counted. Called with the channel lock held.
+ *
+ * Return: true if the writer has more messages than its share
+ */
+static inline bool klog_fair_over(struct klog_channel *ch, struct klog_writer *w) {
+    return (u64)w->count * ch->weight_sum > (u64)ch->nr_entries * klog_writer_weight(w);
+}
+
+/**
+ * klog_fair_heaviest() - Find the writer furthest over its share
+ * @ch: Channel being written to
+ *
+ * Called with the channel lock held.
+ *
+ * Return: Writer with the most messages for its weight among those over
+ * their share, or NULL if every writer is within its share
+ */
+static struct klog_writer *klog_fair_heaviest(struct klog_channel *ch) {
+    struct klog_writer *heaviest = NULL;
+    struct klog_writer *w;
+    unsigned int i;
+
+    for (i = 0; i < KLOG_MAX_WRITERS; i++) {
+        w = &ch->writers[i];
+        if (!w->count || !klog_fair_over(ch, w)) {
+            continue;
+        }
+        if (!heaviest || (u64)w->count * klog_writer_weight(heaviest) >
+                         (u64)heaviest->count * klog_writer_weight(w)) {
+            heaviest = w;
+        }
+    }
+
+    return heaviest;
+}
+
+/**
+ * klog_hdr_purge() - Purge one message
+ * @ch: Channel of the message
+ * @seg: Segment holding the message
+ * @hdr: Header of the message in @seg, not purged yet
+ *
+ * The message keeps its slot and sequence number, only flagged so readers
+ * skip it, and gives back its writer's share at once. Called with the
+ * channel lock held.
+ */
+static void klog_hdr_purge(struct klog_channel *ch, struct klog_seg *seg, struct klog_hdr *hdr) {
+    struct klog_writer *w;
+
+    WRITE_ONCE(hdr->flags, hdr->flags | KLOG_HDR_PURGED);
+    if (hdr->writer != KLOG_NO_WRITER) {
+        w = &ch->writers[hdr->writer];
+        if (!--w->count) {
+            ch->weight_sum -= klog_writer_weight(w);
+        }
+        hdr->writer = KLOG_NO_WRITER;
+    }
+    seg->nr_purged++;
+    WRITE_ONCE(ch->nr_purges, ch->nr_purges + 1);
+}
+
+/**
+ * klog_fair_purge() - Purge the oldest message of a writer
+ * @ch: Channel being written to
+ * @w: Writer entry, with messages in the buffer
+ *
+ * The scan resumes where the previous one for the writer stopped, so each
+ * slot is looked at about once per writer however many of its messages
+ * are purged. Called with the channel lock held.
+ *
+ * Return: true if a message was purged
+ */
+static bool klog_fair_purge(struct klog_channel *ch, struct klog_writer *w) {
+    u16 writer = w - ch->writers;
+    struct klog_seg *prev = NULL;
+    struct klog_seg *seg;
+    struct klog_hdr *hdr;
+    unsigned int i;
+    u64 start = max(w->purge_seq, ch->first_seq);
+    u64 seq;
+
+    for (seq = start - klog_seg_off(start); seq < ch->head_seq; seq += KLOG_SEG_ENTRIES) {
+        seg = rcu_dereference_protected(*klog_seg_slot(ch, seq), lockdep_is_held(&ch->lock));
+        // A compacted segment fills several entries, scan it once
+        if (!seg || seg == prev) {
+            continue;
+        }
+        prev = seg;
+        for (i = 0; i < min_t(u32, seg->count, KLOG_SEG_ENTRIES); i++) {
+            hdr = &seg->hdr[i];
+            if (hdr->writer == writer && hdr->seq >= start && !(hdr->flags & KLOG_HDR_PURGED)) {
+                w->purge_seq = hdr->seq + 1;
+                klog_hdr_purge(ch, seg, hdr);
+                return true;
+            }
+        }
+    }
+    w->purge_seq = ch->head_seq;
+
+    return false;
+}
+
+/**
+ * klog_fair_admit() - Decide whether a writer may add a message
+ * @ch: Channel being written to
+ * @seq: Sequence number the message would get
+ * @id: Writer id from klog_writer_id()
+ *
+ * Once the buffer is full, every message written takes the room of the
+ * oldest message of a writer over its share, see klog_fair_charge(). A
+ * writer at or over its share opening a segment may still only evict a
+ * segment holding nothing but its own messages, or none at all: if the
+ * oldest segment holds someone else's, the new message is dropped until
+ * the compaction work has packed the writer's purged messages into fewer
+ * segments. Called with the channel lock held.
+ *
+ * Return: Writer index to store with the message, or -ENOBUFS
+ */
+static int klog_fair_admit(struct klog_channel *ch, u64 seq, u64 id) {
+    struct klog_writer *w = klog_writer_find(ch, id);
+    struct klog_seg *oldest;
+    u32 weight;
+    u32 sum;
+
+    if (!w) {
+        return KLOG_NO_WRITER;
+    }
+    if (!klog_seg_evicts(ch, seq)) {
+        return w - ch->writers;
+    }
+
+    weight = klog_writer_weight(w);
+    sum = ch->weight_sum + (w->count ? 0 : weight);
+    oldest = rcu_dereference_protected(*klog_seg_slot(ch, ch->first_seq), lockdep_is_held(&ch->lock));
+    if (oldest->writer != w - ch->writers && oldest->count != oldest->nr_purged &&
+        (u64)(w->count + 1) * sum > (u64)ch->nr_entries * weight) {
+        schedule_work(&ch->compact_work);
+        return -ENOBUFS;
+    }
+
+    return w - ch->writers;
+}
+
+/**
+ * klog_fair_charge() - Add a message to the share of its writer
+ * @ch: Channel being written to
+ * @writer: Writer index of the new message, or KLOG_NO_WRITER
+ *
+ * Once the buffer is full, the new message replaces the oldest message of
+ * its own writer if that writer is now over its share, and otherwise the
+ * oldest message of the writer furthest over its share, if any. So the
+ * messages a full buffer loses are taken from the writers over their share
+ * first, on every write and not only when a segment is evicted, and every
+ * share converges to its weight over the sum. The message is purged as
+ * KLOG_IOC_PURGE would, snapshots included, and the compaction work gives
+ * its room back. Called with the channel lock held.
+ */
+static void klog_fair_charge(struct klog_channel *ch, u16 writer) {
+    struct klog_writer *victim;
+    struct klog_writer *w;
+
+    if (writer == KLOG_NO_WRITER) {
+        return;
+    }
+
+    w = &ch->writers[writer];
+    if (!w->count++) {
+        ch->weight_sum += klog_writer_weight(w);
+    }
+    if (!klog_seg_full(ch, ch->head_seq)) {
+        return;
+    }
+
+    victim = klog_fair_over(ch, w) ? w : klog_fair_heaviest(ch);
+    if (victim && klog_fair_purge(ch, victim)) {
+        schedule_work(&ch->compact_work);
+    }
+}
+
+/**
+ * klog_fair_release() - Give back the shares of the messages of a segment
+ * @ch: Channel being written to
+ * @seg: Segment being evicted
+ * @base: First sequence number of the range being evicted
+ *
+ * Called with the channel lock held, once per evicted segment. Only the
+ * messages numbered from @base to the next segment start are released, a
+ * compacted segment covering several of them being evicted piecewise.
+ */
+static void klog_fair_release(struct klog_channel *ch, struct klog_seg *seg, u64 base) {
+    struct klog_writer *w;
+    unsigned int i;
+    u16 writer;
+
+    for (i = 0; i < min_t(u32, seg->count, KLOG_SEG_ENTRIES); i++) {
+        writer = seg->hdr[i].writer;
+        if (writer == KLOG_NO_WRITER || seg->hdr[i].seq - base >= KLOG_SEG_ENTRIES) {
+            continue;
+        }
+        w = &ch->writers[writer];
+        if (!--w->count) {
+            ch->weight_sum -= klog_writer_weight(w);
+        }
+    }
+}
+
+/**
+ * klog_seg_usable() - Check whether a segment may be written over
+ * @seg: Segment of the table, may be NULL
+ *
+ * Called with the channel lock held, which snapshots take to pin segments.
+ *
+ * Return: true if the segment exists, fills one table entry and no snapshot pins it
+ */
+static inline bool klog_seg_usable(struct klog_seg *seg) {
+    return seg && seg->span == 1 && kref_read(&seg->ref) == 1;
+}
+
+/**
+ * klog_seg_unlink() - Drop the reference of one table entry to a segment
+ * @ch: Channel of the segment
+ * @seg: Segment just taken out of a table entry
+ *
+ * A compacted segment stays until its last table entry is unlinked, and a
+ * segment pinned by a snapshot until the last snapshot is dropped. Called
+ * with the channel lock held.
+ *
+ * Return: true if the segment was freed
+ */
+static bool klog_seg_unlink(struct klog_channel *ch, struct klog_seg *seg) {
+    if (!--seg->span) {
+        ch->nr_alloc--;
+    }
+
+    return kref_put(&seg->ref, klog_seg_release);
+}
+
+/**
+ * klog_seg_left() - Account for first_seq moving past a table entry
+ * @ch: Channel whose first_seq just moved one segment on
+ * @seg: Segment the entry pointed to
+ *
+ * A compacted segment stays live until first_seq moves past its last
+ * entry. Called with the channel lock held.
+ */
+static void klog_seg_left(struct klog_channel *ch, struct klog_seg *seg) {
+    if (ch->first_seq >= ch->head_seq ||
+        rcu_access_pointer(*klog_seg_slot(ch, ch->first_seq)) != seg) {
+        WRITE_ONCE(ch->nr_live, ch->nr_live - 1);
+    }
+}
+
+/**
+ * klog_seg_open() - Make room for the first message of a segment
+ * @ch: Channel being written to
+ * @seq: Sequence number of the message, at a segment start
+ *
+ * If klog_seg_evicts() says so, the oldest segment is evicted as a whole,
+ * which is the only eviction check writers make, once per KLOG_SEG_ENTRIES
+ * messages. The new segment reuses, in order of preference, the segment
+ * already in its table entry, the evicted one, or the spare one; segments
+ * pinned by a snapshot are never reused and are freed along with the last
+ * snapshot. Table entries start out empty, so memory is only committed as
+ * the head first reaches each segment, and a burst that grows the buffer
+ * past its quota takes spare segments until it reaches max_entries. Called
+ * with the channel lock held.
+ *
+ * Return: 0 on success, -EAGAIN if a spare segment is needed and missing
+ */
+static int klog_seg_open(struct klog_channel *ch, u64 seq) {
+    struct klog_seg __rcu **slot = klog_seg_slot(ch, seq);
+    struct klog_seg *seg = rcu_dereference_protected(*slot, lockdep_is_held(&ch->lock));
+    struct klog_seg __rcu **old_slot = NULL;
+    struct klog_seg *old = NULL;
+    bool evict = klog_seg_evicts(ch, seq);
+
+    if (evict) {
+        old_slot = klog_seg_slot(ch, ch->first_seq);
+        if (old_slot != slot) {
+            old = rcu_dereference_protected(*old_slot, lockdep_is_held(&ch->lock));
+        }
+    }
+    if (!klog_seg_usable(seg) && !klog_seg_usable(old) && !ch->spare) {
+        return -EAGAIN;
+    }
+
+    if (evict) {
+        if (fair_share != KLOG_FAIR_OFF) {
+            klog_fair_release(ch, old ?: seg, ch->first_seq);
+        }
+        smp_store_release(&ch->first_seq, ch->first_seq + KLOG_SEG_ENTRIES);
+        if (old) {
+            rcu_assign_pointer(*old_slot, NULL);
+        }
+        klog_seg_left(ch, old ?: seg);
+    }
+
+    if (!klog_seg_usable(seg)) {
+        if (seg) {
+            klog_seg_unlink(ch, seg);
+        }
+        if (klog_seg_usable(old)) {
+            seg = old;
+            old = NULL;
+        } else {
+            seg = ch->spare;
+            ch->spare = NULL;
+            seg->span = 1;
+        }
+        rcu_assign_pointer(*slot, seg);
+    }
+    if (old) {
+        klog_seg_unlink(ch, old);
+    }
+    WRITE_ONCE(ch->nr_live, ch->nr_live + 1);
+
+    seg->base = seq;
+    seg->count = 0;
+    seg->nr_purged = 0;
+    seg->compact = false;
+    seg->writer = KLOG_NO_WRITER;
+    WRITE_ONCE(seg->first_ts, 0);
+    WRITE_ONCE(seg->last_ts, 0);
+
+    return 0;
+}
+
+/**
+ * klog_seg_refill() - Allocate the spare segment of a channel
+ * @ch: Channel being written to
+ *
+ * Called without the channel lock, since the allocation may sleep.
+ *
+ * Return: true if the channel has a spare segment
+ */
+static bool klog_seg_refill(struct klog_channel *ch) {
+    struct klog_seg *seg;
+
+    if (READ_ONCE(ch->spare)) {
+        return true;
+    }
+
+    seg = klog_seg_alloc();
+    if (!seg) {
+        return false;
+    }
+    spin_lock(&ch->lock);
+    if (!ch->spare) {
+        ch->spare = seg;
+        ch->nr_alloc++;
+        seg = NULL;
+    }
+    spin_unlock(&ch->lock);
+    klog_seg_put(seg);
+
+    return true;
+}
+
+/**
+ * klog_seg_retire() - Free the segments a channel is not using
+ * @ch: Channel to trim
+ *
+ * Frees the spare segment and every entry of the table that holds no
+ * message between first_seq and head_seq. The next write that needs a
+ * segment allocates one again.
+ *
+ * Return: Number of segments freed
+ */
+static unsigned int klog_seg_retire(struct klog_channel *ch) {
+    struct klog_seg *seg;
+    unsigned int freed = 0;
+    unsigned int i;
+    u64 first_segno;
+    u64 nr_live;
+
+    spin_lock(&ch->lock);
+    if (ch->spare) {
+        klog_seg_put(ch->spare);
+        ch->spare = NULL;
+        ch->nr_alloc--;
+        freed++;
+    }
+    first_segno = klog_segno(ch->first_seq);
+    nr_live = DIV_ROUND_UP(ch->head_seq - ch->first_seq, KLOG_SEG_ENTRIES);
+    for (i = 0; i < ch->nr_segs; i++) {
+        seg = rcu_dereference_protected(ch->segs[i], lockdep_is_held(&ch->lock));
+        if (seg && (((u64)i - first_segno) & (ch->nr_segs - 1)) >= nr_live) {
+            RCU_INIT_POINTER(ch->segs[i], NULL);
+            freed += klog_seg_unlink(ch, seg);
+        }
+    }
+    spin_unlock(&ch->lock);
+
+    return freed;
+}
+
+/**
+ * klog_seg_evict_oldest() - Evict the oldest segment outside of a write
+ * @ch: Channel to shrink, holding more than one segment of messages
+ *
+ * Called with the channel lock held.
+ *
+ * Return: true if the segment was freed, see klog_seg_unlink()
+ */
+static bool klog_seg_evict_oldest(struct klog_channel *ch) {
+    struct klog_seg __rcu **slot = klog_seg_slot(ch, ch->first_seq);
+    struct klog_seg *seg = rcu_dereference_protected(*slot, lockdep_is_held(&ch->lock));
+
+    if (fair_share != KLOG_FAIR_OFF) {
+        klog_fair_release(ch, seg, ch->first_seq);
+    }
+    smp_store_release(&ch->first_seq, ch->first_seq + KLOG_SEG_ENTRIES);
+    rcu_assign_pointer(*slot, NULL);
+    klog_seg_left(ch, seg);
+    atomic_set(&ch->entries, ch->head_seq - ch->first_seq);
+
+    return klog_seg_unlink(ch, seg);
+}
+
+/**
+ * klog_seg_shrink() - Give back the overflow segments consumers are done with
+ * @ch: Channel to shrink
+ *
+ * Evicts the oldest segments while the buffer holds more than its quota in
+ * segments and every consumer has read past them. Called with the channel
+ * lock held, by writers opening a segment and by the retire work for the
+ * channels that are not written to.
+ *
+ * Return: Number of segments evicted
+ */
+static unsigned int klog_seg_shrink(struct klog_channel *ch) {
+    unsigned int freed = 0;
+
+    while (ch->head_seq - ch->first_seq > KLOG_SEG_ENTRIES &&
+           klog_segs_used(ch) > ch->nr_entries / KLOG_SEG_ENTRIES &&
+           !klog_consumers_behind(ch, ch->first_seq + KLOG_SEG_ENTRIES)) {
+        klog_seg_evict_oldest(ch);
+        freed++;
+    }
+
+    return freed;
+}
+
+/**
+ * klog_retire() - Give back memory channels are not using
+ * @work: klog_retire_work
+ *
+ * Runs every retire_ms, or every KLOG_SHRINK_MS if retire_ms is 0 and
+ * channels may grow. Overflow segments left over from a burst are released
+ * once consumers have caught up, for the channels no write has done it
+ * for, and if retire_ms is set a channel that has not been written since
+ * the previous run also gives back what it is not using.
+ */
+static void klog_retire(struct work_struct *work) {
+    struct klog_channel *ch;
+    unsigned int i;
+    u64 head;
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        spin_lock(&ch->lock);
+        klog_seg_shrink(ch);
+        spin_unlock(&ch->lock);
+        head = smp_load_acquire(&ch->head_seq);
+        if (retire_ms && head == ch->retire_seq) {
+            klog_seg_retire(ch);
+        }
+        ch->retire_seq = head;
+    }
+
+    schedule_delayed_work(to_delayed_work(work), msecs_to_jiffies(retire_ms ?: KLOG_SHRINK_MS));
+}
+
+static DECLARE_DELAYED_WORK(klog_retire_work, klog_retire);
+
+/**
+ * klog_seg_reclaimable() - Check whether reclaim may evict the oldest segment
+ * @ch: Channel to look at
+ *
+ * The newest segment and segments a retaining consumer has not read are
+ * never reclaimed, whatever the memory pressure. Called with the channel
+ * lock held, or without it for a hint.
+ *
+ * Return: true if the oldest segment may be evicted
+ */
+static bool klog_seg_reclaimable(struct klog_channel *ch) {
+    u64 first = READ_ONCE(ch->first_seq);
+
+    return READ_ONCE(ch->head_seq) - first > KLOG_SEG_ENTRIES &&
+           !klog_retainers_behind(ch, first + KLOG_SEG_ENTRIES);
+}
+
+/**
+ * klog_seg_coldest() - Find the channel whose oldest segment was written longest ago
+ *
+ * Return: Channel to reclaim from, or NULL if none may be reclaimed from
+ */
+static struct klog_channel *klog_seg_coldest(void) {
+    struct klog_channel *coldest = NULL;
+    struct klog_channel *ch;
+    struct klog_seg *seg;
+    u64 coldest_ts = U64_MAX;
+    u64 ts;
+    unsigned int i;
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        if (!klog_seg_reclaimable(ch)) {
+            continue;
+        }
+        rcu_read_lock();
+        seg = rcu_dereference(*klog_seg_slot(ch, READ_ONCE(ch->first_seq)));
+        ts = seg ? READ_ONCE(seg->last_ts) : 0;
+        rcu_read_unlock();
+        if (ts < coldest_ts || !coldest) {
+            coldest = ch;
+            coldest_ts = ts;
+        }
+    }
+
+    return coldest;
+}
+
+/**
+ * klog_retain_pos() - Get the position of the retaining group furthest behind
+ * @ch: Channel of the groups
+ *
+ * Return: Smallest position of a group with retention enabled, or U64_MAX
+ */
+static u64 klog_retain_pos(struct klog_channel *ch) {
+    struct klog_group *grp;
+    u64 pos = U64_MAX;
+
+    if (!atomic_read(&ch->retainers)) {
+        return pos;
+    }
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(grp, &ch->groups, node) {
+        if (READ_ONCE(grp->retain)) {
+            pos = min_t(u64, pos, atomic64_read(&grp->pos));
+        }
+    }
+    rcu_read_unlock();
+
+    return pos;
+}
+
+/**
+ * klog_seg_freeable() - Count the segments reclaim could free from a channel
+ * @ch: Channel to look at
+ *
+ * The spare segment, and the segments from the oldest one up to the
+ * newest one or to the first one a retaining group has not read, compacted
+ * segments counted once. Called without the channel lock, for an estimate.
+ *
+ * Return: Number of segments klog_shrink_scan() could free
+ */
+static unsigned long klog_seg_freeable(struct klog_channel *ch) {
+    u64 first = READ_ONCE(ch->first_seq);
+    u64 head = READ_ONCE(ch->head_seq);
+    u32 used = klog_segs_used(ch);
+    u64 end;
+    u64 nr;
+
+    nr = READ_ONCE(ch->spare) ? 1 : 0;
+    if (head - first <= KLOG_SEG_ENTRIES || used < 2) {
+        return nr;
+    }
+
+    end = min(head - 1 - klog_seg_off(head - 1), klog_retain_pos(ch));
+    if (end > first) {
+        nr += min_t(u64, (end - first) / KLOG_SEG_ENTRIES, used - 1);
+    }
+
+    return nr;
+}
+
+/**
+ * klog_shrink_count() - Count the segments the shrinker could free
+ * @shrink: klog_shrinker
+ * @sc: Reclaim request
+ *
+ * Return: Number of freeable segments, or SHRINK_EMPTY
+ */
+static unsigned long klog_shrink_count(struct shrinker *shrink, struct shrink_control *sc) {
+    unsigned long count = 0;
+    unsigned int i;
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        count += klog_seg_freeable(klog.channels[i]);
+    }
+
+    return count ?: SHRINK_EMPTY;
+}
+
+/**
+ * klog_shrink_scan() - Free segments under memory pressure
+ * @shrink: klog_shrinker
+ * @sc: Reclaim request
+ *
+ * Segments holding no messages go first. Then the oldest segment of the
+ * channel written to longest ago is evicted, one segment at a time, so
+ * the coldest messages of all channels are dropped before newer ones.
+ * Evicting an entry of a compacted segment, or a segment a snapshot pins,
+ * frees nothing yet, so evictions are what is bounded by nr_to_scan and
+ * only the segments actually freed are reported.
+ *
+ * Return: Number of segments freed, or SHRINK_STOP if none could be
+ */
+static unsigned long klog_shrink_scan(struct shrinker *shrink, struct shrink_control *sc) {
+    struct klog_channel *ch;
+    unsigned long scanned;
+    unsigned long freed = 0;
+    unsigned int i;
+
+    for (i = 0; i < klog.nr_channels && freed < sc->nr_to_scan; i++) {
+        freed += klog_seg_retire(klog.channels[i]);
+    }
+    scanned = freed;
+
+    while (scanned < sc->nr_to_scan && (ch = klog_seg_coldest())) {
+        spin_lock(&ch->lock);
+        if (!klog_seg_reclaimable(ch)) {
+            spin_unlock(&ch->lock);
+            break;
+        }
+        freed += klog_seg_evict_oldest(ch);
+        scanned++;
+        spin_unlock(&ch->lock);
+    }
+    sc->nr_scanned = scanned;
+
+    return freed ?: SHRINK_STOP;
+}
+
+/**
+ * klog_seg_recycle() - Turn the oldest segment of a channel into its spare one
+ * @ch: Channel being written to, with no spare segment
+ *
+ * Called with the channel lock held when a segment cannot be allocated,
+ * typically because the memory cgroup the writer is charged to is at its
+ * limit. The channel then keeps writing by wrapping within the segments it
+ * already has, as reclaim would have it do, rather than failing the write.
+ * The newest segment and segments a retaining consumer has not read are
+ * never recycled.
+ *
+ * Return: true if the channel has a spare segment
+ */
+static bool klog_seg_recycle(struct klog_channel *ch) {
+    struct klog_seg __rcu **slot = klog_seg_slot(ch, ch->first_seq);
+    struct klog_seg *seg = rcu_dereference_protected(*slot, lockdep_is_held(&ch->lock));
+
+    if (ch->spare) {
+        return true;
+    }
+    if (!klog_seg_reclaimable(ch) || !klog_seg_usable(seg)) {
+        return false;
+    }
+
+    if (fair_share != KLOG_FAIR_OFF) {
+        klog_fair_release(ch, seg, ch->first_seq);
+    }
+    smp_store_release(&ch->first_seq, ch->first_seq + KLOG_SEG_ENTRIES);
+    rcu_assign_pointer(*slot, NULL);
+    klog_seg_left(ch, seg);
+    atomic_set(&ch->entries, ch->head_seq - ch->first_seq);
+    ch->spare = seg;
+
+    return true;
+}
+
+/*
+ * Gives segments back to the system under memory pressure. It is not
+ * memcg aware: a memcg aware shrinker is only called for the cgroups
+ * whose shrinker bit is set, which only list_lru and slab do, while the
+ * segments of a channel are evicted oldest first whichever cgroup each is
+ * charged to. A writer whose cgroup is at its limit gets its segment from
+ * klog_seg_recycle() instead.
+ */
+static struct shrinker *klog_shrinker;
+
+/**
+ * klog_weight_set() - Set the weight of a writer of a channel
+ * @ch: Channel the weight applies to
+ * @uweight: User space weight request
+ *
+ * Only an administrator may change how the buffer is shared.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_weight_set(struct klog_channel *ch, struct klog_weight __user *uweight) {
+    struct klog_weight req;
+    struct klog_writer *w;
+    int err = 0;
+
+    if (fair_share == KLOG_FAIR_OFF) {
+        return -EOPNOTSUPP;
+    }
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (copy_from_user(&req, uweight, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.pad) {
+        return -EINVAL;
+    }
+    if (!req.id) {
+        req.id = klog_writer_id();
+    }
+
+    spin_lock(&ch->lock);
+    w = klog_writer_find(ch, req.id);
+    if (!w) {
+        err = -ENOSPC;
+    } else {
+        if (w->count) {
+            ch->weight_sum += (req.weight ?: KLOG_WEIGHT_DEFAULT) - klog_writer_weight(w);
+        }
+        w->weight = req.weight;
+    }
+    spin_unlock(&ch->lock);
+
+    return err;
+}
+
+/**
+ * klog_msg_text() - Skip the severity prefix of a message
+ * @msg: NUL-terminated message
+ *
+ * Return: Text of the message after its "<N>" prefix, if it has one
+ */
+static const char *klog_msg_text(const char *msg) {
+    int i;
+
+    if (msg[0] != '<') {
+        return msg;
+    }
+    for (i = 1; i <= 3 && isdigit(msg[i]); i++) {
+    }
+    if (i == 1 || msg[i] != '>') {
+        return msg;
+    }
+
+    return msg + i + 1;
+}
+
+/**
+ * klog_purge_match() - Check whether a message is to be purged
+ * @req: Purge request, its strings NUL-terminated
+ * @hdr: Header of the message
+ * @msg: Text of the message, at most MSG_LEN bytes
+ *
+ * Return: true if the message matches every criterion of @req
+ */
+static bool klog_purge_match(const struct klog_purge *req, const struct klog_hdr *hdr, const char *msg) {
+    char text[MSG_LEN + 1];
+    const char *body;
+
+    if ((req->flags & KLOG_PURGE_PID) && hdr->pid != req->pid) {
+        return false;
+    }
+    if (!(req->flags & (KLOG_PURGE_TAG | KLOG_PURGE_TEXT))) {
+        return true;
+    }
+
+    memcpy(text, msg, MSG_LEN);
+    text[MSG_LEN] = '\0';
+    body = klog_msg_text(text);
+    if ((req->flags & KLOG_PURGE_TAG) && strncmp(body, req->tag, strlen(req->tag))) {
+        return false;
+    }
+    if ((req->flags & KLOG_PURGE_TEXT) && !strstr(body, req->text)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * klog_seg_purge() - Purge the matching messages of one segment
+ * @ch: Channel of the segment
+ * @seg: Segment in the table of @ch
+ * @req: Purge request, its strings NUL-terminated
+ *
+ * Messages are purged by klog_hdr_purge(). Called with the channel lock
+ * held, which keeps the segment from being reused.
+ *
+ * Return: Number of messages purged
+ */
+static unsigned int klog_seg_purge(struct klog_channel *ch, struct klog_seg *seg, const struct klog_purge *req) {
+    struct klog_hdr *hdr;
+    unsigned int purged = 0;
+    unsigned int i;
+
+    for (i = 0; i < min_t(u32, seg->count, KLOG_SEG_ENTRIES); i++) {
+        hdr = &seg->hdr[i];
+        if ((hdr->flags & KLOG_HDR_PURGED) || hdr->seq < ch->first_seq ||
+            !klog_purge_match(req, hdr, seg->data + i * MSG_LEN)) {
+            continue;
+        }
+
+        klog_hdr_purge(ch, seg, hdr);
+        purged++;
+    }
+
+    return purged;
+}
+
+/**
+ * klog_purge() - Delete the messages of a channel that match a request
+ * @ch: Channel to purge
+ * @upurge: User space purge request
+ *
+ * A message matches if it was written by the given process, if its text
+ * after the severity prefix starts with the given tag, and if it contains
+ * the given string, for each criterion present in the flags. The channel
+ * lock is taken one segment at a time, so writers are only held back for
+ * the scan of a single segment. The space is reclaimed afterwards by the
+ * compaction work. Only an administrator may delete messages.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_purge(struct klog_channel *ch, struct klog_purge __user *upurge) {
+    struct klog_seg *prev = NULL;
+    struct klog_seg *seg;
+    struct klog_purge req;
+    u64 seq;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (copy_from_user(&req, upurge, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (!req.flags || (req.flags & ~(KLOG_PURGE_PID | KLOG_PURGE_TAG | KLOG_PURGE_TEXT))) {
+        return -EINVAL;
+    }
+    req.tag[sizeof(req.tag) - 1] = '\0';
+    req.text[sizeof(req.text) - 1] = '\0';
+    req.purged = 0;
+
+    for (seq = klog_first_seq(ch); ; seq += KLOG_SEG_ENTRIES) {
+        spin_lock(&ch->lock);
+        if (seq < ch->first_seq) {
+            seq = ch->first_seq;
+        }
+        if (seq >= ch->head_seq) {
+            spin_unlock(&ch->lock);
+            break;
+        }
+        seg = rcu_dereference_protected(*klog_seg_slot(ch, seq), lockdep_is_held(&ch->lock));
+        // A compacted segment fills several entries, scan it once
+        if (seg && seg != prev) {
+            req.purged += klog_seg_purge(ch, seg, &req);
+        }
+        prev = seg;
+        spin_unlock(&ch->lock);
+        cond_resched();
+    }
+
+    if (req.purged) {
+        schedule_work(&ch->compact_work);
+    }
+    if (put_user(req.purged, &upurge->purged)) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * klog_seg_merge() - Replace a run of segments with a compacted one
+ * @ch: Channel of the segments
+ * @c: Empty segment receiving the messages left in the run
+ * @start: Sequence number of the first entry of the run
+ * @len: Number of table entries in the run
+ *
+ * Called with the channel lock held. The messages are copied in order and
+ * @c is only published once complete; a reader still on one of the old
+ * segments notices it was swapped out and retries on @c.
+ */
+static void klog_seg_merge(struct klog_channel *ch, struct klog_seg *c, u64 start, unsigned int len) {
+    struct klog_seg __rcu **slot;
+    struct klog_seg *seg;
+    unsigned int n = 0;
+    unsigned int i, j;
+
+    c->base = start;
+    c->compact = true;
+    c->writer = KLOG_NO_WRITER;
+    for (i = 0; i < len; i++) {
+        seg = rcu_dereference_protected(*klog_seg_slot(ch, start + i * KLOG_SEG_ENTRIES),
+                                        lockdep_is_held(&ch->lock));
+        if (!i) {
+            c->first_ts = seg->first_ts;
+        }
+        c->last_ts = seg->last_ts;
+        if (seg->writer != KLOG_NO_WRITER) {
+            c->writer = c->writer == KLOG_NO_WRITER || c->writer == seg->writer ?
+                        seg->writer : KLOG_MIXED_WRITER;
+        }
+        for (j = 0; j < seg->count; j++) {
+            if (seg->hdr[j].flags & KLOG_HDR_PURGED) {
+                continue;
+            }
+            c->hdr[n] = seg->hdr[j];
+            memcpy(c->data + n * MSG_LEN, seg->data + j * MSG_LEN, MSG_LEN);
+            n++;
+        }
+    }
+    c->count = n;
+    c->span = len;
+    for (i = 1; i < len; i++) {
+        kref_get(&c->ref);
+    }
+    ch->nr_alloc++;
+    WRITE_ONCE(ch->nr_live, ch->nr_live - (len - 1));
+
+    for (i = 0; i < len; i++) {
+        slot = klog_seg_slot(ch, start + i * KLOG_SEG_ENTRIES);
+        seg = rcu_dereference_protected(*slot, lockdep_is_held(&ch->lock));
+        rcu_assign_pointer(*slot, c);
+        klog_seg_unlink(ch, seg);
+    }
+}
+
+/**
+ * klog_compact_run() - Compact the first run of sparse segments of a channel
+ * @ch: Channel to compact
+ * @c: Empty segment to compact into
+ * @from: In: sequence number to start looking at. Out: where to look next
+ *
+ * A run is a sequence of adjacent full segments whose remaining messages
+ * fit in one segment together, holding at least one purged message. The
+ * segment being written and segments pinned by a snapshot are left alone.
+ * Called with the channel lock held.
+ *
+ * Return: true if @c was used
+ */
+static bool klog_compact_run(struct klog_channel *ch, struct klog_seg *c, u64 *from) {
+    struct klog_seg *seg;
+    unsigned int live = 0;
+    unsigned int len = 0;
+    bool purged = false;
+    unsigned int n;
+    u64 start;
+    u64 seq;
+
+    start = max(*from, ch->first_seq);
+    for (seq = start; seq + KLOG_SEG_ENTRIES <= ch->head_seq; seq += KLOG_SEG_ENTRIES) {
+        seg = rcu_dereference_protected(*klog_seg_slot(ch, seq), lockdep_is_held(&ch->lock));
+        n = klog_seg_usable(seg) && !seg->compact ? seg->count - seg->nr_purged : KLOG_SEG_ENTRIES + 1;
+        if (live + n > KLOG_SEG_ENTRIES) {
+            if (len > 1 && purged) {
+                break;
+            }
+            // Start over from this segment, or after it if it cannot be merged at all
+            start = n > KLOG_SEG_ENTRIES ? seq + KLOG_SEG_ENTRIES : seq;
+            live = 0;
+            len = 0;
+            purged = false;
+            if (n > KLOG_SEG_ENTRIES) {
+                continue;
+            }
+        }
+        live += n;
+        purged |= seg->nr_purged != 0;
+        len++;
+    }
+
+    if (len < 2 || !purged) {
+        *from = seq;
+        return false;
+    }
+    *from = start + len * KLOG_SEG_ENTRIES;
+    klog_seg_merge(ch, c, start, len);
+
+    return true;
+}
+
+/**
+ * klog_compact() - Reclaim the space of purged messages
+ * @work: compact_work of the channel
+ *
+ * Runs after KLOG_IOC_PURGE. Each run of segments is packed into a fresh
+ * one under the channel lock, the allocation being made beforehand.
+ */
+static void klog_compact(struct work_struct *work) {
+    struct klog_channel *ch = container_of(work, struct klog_channel, compact_work);
+    struct klog_seg *c = NULL;
+    u64 from = 0;
+    bool more = true;
+
+    while (more) {
+        if (!c) {
+            c = klog_seg_alloc();
+            if (!c) {
+                return;
+            }
+        }
+        spin_lock(&ch->lock);
+        more = klog_compact_run(ch, c, &from);
+        spin_unlock(&ch->lock);
+        if (more) {
+            c = NULL;
+        }
+        cond_resched();
+    }
+    klog_seg_put(c);
+}
+
+/**
+ * dev_read_iter() - Read messages from the circular buffer
+ * @iocb: I/O control block; ki_pos holds the sequence number of the next message
+ * @to: Destination iterator in user space
+ *
+ * The file position is a message sequence number rather than a byte offset,
+ * so a reader always resumes on a message boundary.
+ *
+ * A plain read() gets as many whole messages as fit in the buffer, back to
+ * back. A readv() with several iovecs gets exactly one message per iovec:
+ * the message is copied to the start of the iovec, followed by a '\0' if it
+ * fits, and the rest of the iovec is skipped. The return value then covers
+ * every iovec that was used, so the number of messages returned is the
+ * number of iovecs consumed. Empty iovecs are skipped and take no message.
+ * A readv() with a single iovec is the exception: the VFS hands it over as
+ * ITER_UBUF, exactly like read(), so it cannot be told apart and gets the
+ * packed read() behaviour.
+ *
+ * Members of a consumer group read from the group position instead of the
+ * file position. Each message is claimed with a cmpxchg on that position
+ * once it is known to fit, so it is delivered to exactly one member. When
+ * nothing is pending a member blocks, unless the file is non-blocking, and
+ * a member that leaves messages behind wakes the next one.
+ *
+ * Channels on another backend are read by the backend instead.
+ *
+ * Return: Number of bytes read, or negative error code on failure
+ */
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct klog_file *kf = iocb->ki_filp->private_data;
+    struct klog_channel *ch = kf->ch;
+    struct klog_group *grp = klog_group_get(kf);
+    // readv() with one iovec arrives as ITER_UBUF and reads like read()
+    bool per_iovec = iter_is_iovec(to);
+    u64 seq = iocb->ki_pos;
+    char msg[MSG_LEN];
+    size_t seg_len;
+    ssize_t bytes_read = 0;
+    ssize_t len;
+    s64 claim;
+
+    if (ch->backend->read) {
+        return ch->backend->read(ch, iocb, to);
+    }
+
+    while (iov_iter_count(to)) {
+        // An empty iovec has no room for a message, skip it without taking one
+        if (per_iovec && !iov_iter_single_seg_count(to)) {
+            iov_iter_advance(to, 0);
+            continue;
+        }
+
+        if (grp) {
+            claim = atomic64_read(&grp->pos);
+            seq = claim;
+        }
+
+        len = klog_file_fetch(kf, &seq, msg);
+        if (len < 0) {
+            // Step the group over purged messages it would otherwise wait on
+            if (grp && seq > claim && atomic64_try_cmpxchg(&grp->pos, &claim, seq)) {
+                continue;
+            }
+            if (!grp || bytes_read) {
+                break;
+            }
+            if (iocb->ki_filp->f_flags & O_NONBLOCK) {
+                bytes_read = -EAGAIN;
+                break;
+            }
+            if (wait_event_interruptible_exclusive(grp->wait, klog_group_pending(ch, grp))) {
+                bytes_read = -ERESTARTSYS;
+                break;
+            }
+            continue;
+        }
+
+        seg_len = per_iovec ? iov_iter_single_seg_count(to) : iov_iter_count(to);
+        if (len > seg_len) {
+            // Never split a message across two reads; only truncate
+            // when the very first one cannot fit at all
+            if (!per_iovec && bytes_read) {
+                break;
+            }
+            len = seg_len;
+        } else if (per_iovec && len < seg_len && len < MSG_LEN) {
+            msg[len++] = '\0';
+        }
+
+        // Another member got this message first, try the next one
+        if (grp && !atomic64_try_cmpxchg(&grp->pos, &claim, seq + 1)) {
+            continue;
+        }
+
+        if (copy_to_iter(msg, len, to) != len) {
+            if (!bytes_read) {
+                bytes_read = -EFAULT;
+            }
+            break;
+        }
+        if (per_iovec) {
+            iov_iter_advance(to, seg_len - len);
+            len = seg_len;
+        }
+
+        bytes_read += len;
+        iocb->ki_pos = ++seq;
+    }
+
+    if (grp) {
+        // Hand what is left over to another member
+        if (bytes_read > 0 && klog_group_pending(ch, grp)) {
+            wake_up_interruptible(&grp->wait);
+        }
+        // Room may have been made for writers held back by retention
+        if (bytes_read > 0 && READ_ONCE(grp->retain) && wq_has_sleeper(&ch->retain_wait)) {
+            wake_up_interruptible(&ch->retain_wait);
+        }
+        klog_group_put(grp);
+    }
+
+    if (bytes_read > 0) {
+        WRITE_ONCE(kf->read_seq, seq);
+        klog_notify_rearm(kf);
+    }
+
+    return bytes_read;
+}
+
+/**
+ * dev_llseek() - Move the read position to another message
+ * @filep: Pointer to the file object
+ * @offset: Offset in messages
+ * @whence: SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * Offsets count messages, not bytes. SEEK_END is relative to the next message
+ * to be written, so seeking to -N from the end positions the reader on the
+ * newest N messages without walking the rest of the buffer. If fewer than N
+ * messages are available it stops at the oldest one.
+ *
+ * Return: New position, or negative error code on failure
+ */
+static loff_t dev_llseek(struct file *filep, loff_t offset, int whence) {
+    u64 first;
+    u64 head;
+    loff_t pos;
+
+    klog_file_bounds(filep->private_data, &first, &head);
+
+    switch (whence) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = filep->f_pos + offset;
+        break;
+    case SEEK_END:
+        pos = head + offset;
+        if (offset < 0 && -offset > head - first) {
+            pos = first;
+        }
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (pos < 0) {
+        return -EINVAL;
+    }
+
+    filep->f_pos = pos;
+    WRITE_ONCE(((struct klog_file *)filep->private_data)->read_seq, pos);
+    return pos;
+}
+
+/**
+ * dev_poll() - Report whether a reader has messages or a pressure event
+ * @filep: Pointer to the file object
+ * @wait: Poll table
+ *
+ * Return: POLLIN if unread messages are available, POLLPRI once per pressure
+ * crossing, and always POLLOUT
+ */
+static __poll_t dev_poll(struct file *filep, poll_table *wait) {
+    struct klog_file *kf = filep->private_data;
+    struct klog_channel *ch = kf->ch;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filep, &ch->poll_wait, wait);
+
+    rcu_read_lock();
+    if (klog_file_lag(kf, smp_load_acquire(&ch->head_seq))) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    rcu_read_unlock();
+
+    if (READ_ONCE(kf->pressure_event) && xchg(&kf->pressure_event, false)) {
+        mask |= EPOLLPRI;
+    }
+
+    return mask;
+}
+
+/**
+ * klog_reserve() - Make room for the next message of a channel
+ * @ch: Channel being written to
+ * @filep: File of the writer, for retention waits, or NULL to never wait
+ * @writer_id: Identity of the writer from klog_writer_id(), in fair share mode
+ * @writer: Out: index of the writer in fair share mode, or NULL to bypass fair sharing
+ *
+ * Waits for retaining consumers, admits the writer against its fair share
+ * and opens a segment if head_seq starts one, recycling the oldest one if
+ * no segment can be allocated and releasing overflow segments consumers
+ * are done with. Called with the channel lock held, which is
+ * still held on success and released on failure.
+ *
+ * Return: 0 if the slot at head_seq is ready to be written, negative error code on failure
+ */
+static int klog_reserve(struct klog_channel *ch, struct file *filep, u64 writer_id, int *writer) {
+    bool refilled;
+    int err;
+
+retry:
+    while (klog_retain_blocked(ch, ch->head_seq)) {
+        spin_unlock(&ch->lock);
+        err = klog_retain_wait(ch, filep);
+        if (err) {
+            return err;
+        }
+        spin_lock(&ch->lock);
+    }
+
+    if (writer && fair_share != KLOG_FAIR_OFF) {
+        *writer = klog_fair_admit(ch, ch->head_seq, writer_id);
+        if (*writer < 0) {
+            spin_unlock(&ch->lock);
+            return *writer;
+        }
+    }
+
+    if (!klog_seg_off(ch->head_seq)) {
+        if (klog_seg_open(ch, ch->head_seq) == -EAGAIN) {
+            // Allocating a segment may sleep, so do it unlocked and start over
+            spin_unlock(&ch->lock);
+            refilled = klog_seg_refill(ch);
+            spin_lock(&ch->lock);
+            if (!refilled && !klog_seg_recycle(ch)) {
+                spin_unlock(&ch->lock);
+                return -ENOMEM;
+            }
+            goto retry;
+        }
+        // Give back the overflow of a burst once consumers caught up
+        klog_seg_shrink(ch);
+    }
+
+    return 0;
+}
+
+/**
+ * klog_commit() - Write one message at the head of a channel and publish it
+ * @ch: Channel being written to, made ready by klog_reserve()
+ * @msg: Text of the message, or NULL for a purged placeholder
+ * @len: Length of @msg, less than MSG_LEN
+ * @tmpl: Time, level, flags, writer and pid of the message
+ *
+ * Every message also takes the next global sequence number, which orders
+ * it against the messages of every other channel. It is taken under the
+ * channel lock, so it grows along the channel like the channel sequence
+ * does, and the channel is flagged as writing from before the number is
+ * taken until the message is published, so the mux reader can tell when a
+ * smaller number may still show up in a channel that looks empty. A
+ * placeholder takes no global sequence number, since no reader ever sees
+ * it. Called with the channel lock held.
+ *
+ * Return: Sequence number of the message
+ */
+static u64 klog_commit(struct klog_channel *ch, const char *msg, size_t len, const struct klog_hdr *tmpl) {
+    u64 seq = ch->head_seq;
+    unsigned int off = klog_seg_off(seq);
+    struct klog_seg *seg = rcu_dereference_protected(*klog_seg_slot(ch, seq), lockdep_is_held(&ch->lock));
+    struct klog_hdr *hdr = &seg->hdr[off];
+    u64 now = tmpl->ts_ns;
+
+    if (!off) {
+        seg->writer = tmpl->writer;
+    } else if (seg->writer != tmpl->writer) {
+        seg->writer = KLOG_MIXED_WRITER;
+    }
+
+    if (msg) {
+        // Announce the write before taking a global sequence number
+        WRITE_ONCE(ch->writing, true);
+        smp_mb();
+    }
+
+    // Keep timestamps ordered by sequence so they can be binary searched
+    if (now < ch->last_ts) {
+        now = ch->last_ts;
+    }
+
+    // Invalidate the slot before overwriting it so readers notice
+    WRITE_ONCE(hdr->seq, SLOT_BUSY);
+    smp_wmb();
+    if (msg) {
+        memcpy(seg->data + off * MSG_LEN, msg, len);
+        seg->data[off * MSG_LEN + len] = '\0';
+        hdr->gseq = atomic64_fetch_inc(&klog.gseq);
+    } else {
+        hdr->gseq = 0;
+        seg->nr_purged++;
+    }
+    hdr->ts_ns = now;
+    hdr->level = tmpl->level;
+    hdr->flags = msg ? tmpl->flags : KLOG_HDR_PURGED;
+    hdr->writer = tmpl->writer;
+    hdr->pid = tmpl->pid;
+    smp_store_release(&hdr->seq, seq);
+
+    if (!off) {
+        WRITE_ONCE(seg->first_ts, now);
+    }
+    WRITE_ONCE(seg->last_ts, now);
+    seg->count++;
+    ch->last_ts = now;
+    atomic_set(&ch->entries, seq + 1 - ch->first_seq);
+
+    smp_store_release(&ch->head_seq, seq + 1);
+    if (msg) {
+        smp_store_release(&ch->writing, false);
+    }
+
+    if (fair_share != KLOG_FAIR_OFF) {
+        klog_fair_charge(ch, tmpl->writer);
+    }
+
+    return seq;
+}
+
+/**
+ * klog_write_wake() - Wake up the readers of new messages
+ * @ch: Channel written to
+ * @head: head_seq after the write
+ *
+ * Called without the channel lock.
+ */
+static void klog_write_wake(struct klog_channel *ch, u64 head) {
+    klog_groups_wake(ch);
+    klog_notify_all(ch, head);
+    if (wq_has_sleeper(&ch->poll_wait)) {
+        wake_up_interruptible_poll(&ch->poll_wait, EPOLLIN | EPOLLRDNORM);
+    }
+}
+
+/**
+ * klog_import_gap() - Skip whole segments missing from a dump
+ * @ch: Channel being restored into, its head at a segment start
+ * @nr: Number of segments to skip
+ *
+ * The skipped entries of the table all point to one empty compacted
+ * segment, which readers step over, rather than to placeholder messages
+ * that would take a segment each. The oldest segments are evicted as a
+ * write past the end of the table would evict them. Called with the channel lock
+ * held, and with a spare segment.
+ */
+static void klog_import_gap(struct klog_channel *ch, u64 nr) {
+    struct klog_seg __rcu **slot;
+    struct klog_seg *c;
+    struct klog_seg *seg;
+    u64 head = ch->head_seq;
+    u64 i;
+
+    while (ch->first_seq < head && head + nr * KLOG_SEG_ENTRIES - ch->first_seq > klog_seg_span(ch)) {
+        klog_seg_evict_oldest(ch);
+    }
+    // Nothing left to keep, jump over the gap as an empty channel would
+    if (ch->first_seq == head) {
+        smp_store_release(&ch->first_seq, head + nr * KLOG_SEG_ENTRIES);
+        smp_store_release(&ch->head_seq, ch->first_seq);
+        return;
+    }
+
+    c = ch->spare;
+    ch->spare = NULL;
+    c->base = head;
+    c->count = 0;
+    c->nr_purged = 0;
+    c->compact = true;
+    c->writer = KLOG_NO_WRITER;
+    c->first_ts = ch->last_ts;
+    c->last_ts = ch->last_ts;
+    c->span = nr;
+    for (i = 1; i < nr; i++) {
+        kref_get(&c->ref);
+    }
+
+    for (i = 0; i < nr; i++) {
+        slot = klog_seg_slot(ch, head + i * KLOG_SEG_ENTRIES);
+        seg = rcu_dereference_protected(*slot, lockdep_is_held(&ch->lock));
+        rcu_assign_pointer(*slot, c);
+        if (seg) {
+            klog_seg_unlink(ch, seg);
+        }
+    }
+    WRITE_ONCE(ch->nr_live, ch->nr_live + 1);
+    atomic_set(&ch->entries, head + nr * KLOG_SEG_ENTRIES - ch->first_seq);
+    smp_store_release(&ch->head_seq, head + nr * KLOG_SEG_ENTRIES);
+}
+
+/**
+ * klog_import_one() - Restore one message of a dump at its sequence number
+ * @ch: Channel being restored into
+ * @filep: File of the importer, for retention waits
+ * @rec: Header of the message in the dump
+ * @text: Text of the message, @rec->len bytes
+ *
+ * An empty channel first moves to the segment of @rec, so a dump restores
+ * at its original sequence numbers. Messages missing from the dump between
+ * two of its messages are filled in as purged placeholders, which readers
+ * skip, up to the end of a segment; whole segments missing are skipped by
+ * klog_import_gap(), so the lock is never held for more than a segment of
+ * placeholders. Takes the channel lock for the one record only, so writers
+ * are held back no longer than by a write.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_import_one(struct klog_channel *ch, struct file *filep,
+                           const struct klog_record *rec, const char *text) {
+    struct klog_hdr tmpl = {
+        .ts_ns = rec->ts_ns,
+        .level = rec->level,
+        .writer = KLOG_NO_WRITER,
+    };
+    struct klog_hdr gap = { .writer = KLOG_NO_WRITER };
+    u64 nr;
+    int err;
+
+    spin_lock(&ch->lock);
+retry:
+    if (ch->head_seq == ch->first_seq && rec->seq > ch->head_seq &&
+        klog_segno(rec->seq) != klog_segno(ch->head_seq)) {
+        smp_store_release(&ch->first_seq, klog_segno(rec->seq) * KLOG_SEG_ENTRIES);
+        smp_store_release(&ch->head_seq, ch->first_seq);
+    }
+    // Never rewrite history, nor fill in more than the buffer can hold
+    if (rec->seq < ch->head_seq || rec->seq - ch->head_seq > klog_seg_span(ch)) {
+        spin_unlock(&ch->lock);
+        return -ERANGE;
+    }
+
+    // Finish the head segment with placeholders
+    while (ch->head_seq < rec->seq && klog_seg_off(ch->head_seq)) {
+        err = klog_reserve(ch, filep, 0, NULL);
+        if (err) {
+            // klog_reserve() released the lock
+            return err;
+        }
+        gap.ts_ns = ch->last_ts;
+        klog_commit(ch, NULL, 0, &gap);
+    }
+
+    nr = klog_segno(rec->seq) - klog_segno(ch->head_seq);
+    if (nr) {
+        if (!ch->spare) {
+            // Allocating a segment may sleep, so do it unlocked and start over
+            spin_unlock(&ch->lock);
+            if (!klog_seg_refill(ch)) {
+                return -ENOMEM;
+            }
+            spin_lock(&ch->lock);
+            goto retry;
+        }
+        klog_import_gap(ch, nr);
+    }
+
+    while (ch->head_seq < rec->seq) {
+        err = klog_reserve(ch, filep, 0, NULL);
+        if (err) {
+            return err;
+        }
+        gap.ts_ns = ch->last_ts;
+        klog_commit(ch, NULL, 0, &gap);
+    }
+
+    err = klog_reserve(ch, filep, 0, NULL);
+    if (err) {
+        return err;
+    }
+    klog_commit(ch, text, rec->len, &tmpl);
+    spin_unlock(&ch->lock);
+
+    return 0;
+}
+
+/**
+ * klog_import() - Restore a dump of mux records into a channel
+ * @filep: Pointer to the file object of the channel
+ * @uimport: User space import request
+ *
+ * The dump is the output of the mux in record mode: struct klog_record
+ * headers, each followed by its text padded to KLOG_RECORD_ALIGN. The
+ * records of one channel of the dump are restored with their sequence
+ * numbers, timestamps and levels, and can then be read, seeked and
+ * searched by time like any other. The dump is copied in by chunks and
+ * restored one record per hold of the channel lock, readers being woken
+ * and the CPU given up every KLOG_IMPORT_BATCH records. Only whole records
+ * are consumed, so a dump can be fed in pieces; a trailing
+ * partial record is left for the next call. Only an administrator may
+ * import, since the messages keep their original identity.
+ *
+ * Return: 0 on success, negative error code if nothing could be imported
+ */
+static int klog_import(struct file *filep, struct klog_import __user *uimport) {
+    struct klog_channel *ch = ((struct klog_file *)filep->private_data)->ch;
+    const char __user *ubuf;
+    struct klog_import req;
+    struct klog_record rec;
+    size_t rec_len;
+    size_t off, n;
+    char *buf;
+    int err = 0;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (copy_from_user(&req, uimport, sizeof(req))) {
+        return -EFAULT;
+    }
+    if (req.pad) {
+        return -EINVAL;
+    }
+    ubuf = u64_to_user_ptr(req.buf);
+    req.consumed = 0;
+    req.imported = 0;
+
+    buf = kvmalloc(KLOG_IMPORT_CHUNK, GFP_KERNEL);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    while (!err && req.consumed < req.len) {
+        n = min_t(u64, req.len - req.consumed, KLOG_IMPORT_CHUNK);
+        if (copy_from_user(buf, ubuf + req.consumed, n)) {
+            err = -EFAULT;
+            break;
+        }
+
+        for (off = 0; off + sizeof(rec) <= n; off += rec_len) {
+            memcpy(&rec, buf + off, sizeof(rec));
+            rec_len = sizeof(rec) + ALIGN(rec.len, KLOG_RECORD_ALIGN);
+            if (rec.len >= MSG_LEN) {
+                err = -EINVAL;
+                break;
+            }
+            if (off + rec_len > n) {
+                break;
+            }
+            if (rec.channel != req.channel) {
+                continue;
+            }
+            err = klog_import_one(ch, filep, &rec, buf + off + sizeof(rec));
+            if (err) {
+                break;
+            }
+            if (!(++req.imported % KLOG_IMPORT_BATCH)) {
+                klog_write_wake(ch, smp_load_acquire(&ch->head_seq));
+                cond_resched();
+            }
+        }
+        klog_write_wake(ch, smp_load_acquire(&ch->head_seq));
+
+        req.consumed += off;
+        // Stop at a partial record at the end of the dump
+        if (!off) {
+            break;
+        }
+        cond_resched();
+    }
+    kvfree(buf);
+
+    if (err && !req.imported) {
+        return err;
+    }
+    if (copy_to_user(uimport, &req, sizeof(req))) {
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+/**
+ * dev_ioctl() - Handle control requests on the device
+ * @filep: Pointer to the file object
+ * @cmd: One of the KLOG_IOC_* commands from klogger.h
+ * @arg: Command argument
+ *
+ * Every command works on the ring, so channels on another backend have none.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct klog_file *kf = filep->private_data;
+
+    if (!klog_is_ring(kf->ch)) {
+        return -EOPNOTSUPP;
+    }
+
+    switch (cmd) {
+    case KLOG_IOC_SNAPSHOT:
+        return klog_snapshot_take(filep, (struct klog_snapshot __user *)arg);
+    case KLOG_IOC_SNAPSHOT_RELEASE:
+        klog_snapshot_drop(filep->private_data);
+        return 0;
+    case KLOG_IOC_GROUP_JOIN:
+        return klog_group_join(filep->private_data, (struct klog_group_req __user *)arg);
+    case KLOG_IOC_GROUP_LEAVE:
+        klog_group_leave(filep->private_data);
+        return 0;
+    case KLOG_IOC_OFFSET_GET:
+    case KLOG_IOC_OFFSET_SET:
+    case KLOG_IOC_OFFSET_DELETE:
+        return klog_offset_ioctl(kf->ch, cmd, (struct klog_offset __user *)arg);
+    case KLOG_IOC_NOTIFY:
+        return klog_notify_register(filep->private_data, (struct klog_notify __user *)arg);
+    case KLOG_IOC_PRESSURE:
+        return klog_pressure_register(filep->private_data, (struct klog_pressure __user *)arg);
+    case KLOG_IOC_WEIGHT:
+        return klog_weight_set(kf->ch, (struct klog_weight __user *)arg);
+    case KLOG_IOC_PURGE:
+        return klog_purge(kf->ch, (struct klog_purge __user *)arg);
+    case KLOG_IOC_IMPORT:
+        return klog_import(filep, (struct klog_import __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * klog_parse_level() - Get the severity of a message
+ * @msg: NUL-terminated message
+ *
+ * Messages may start with a syslog priority such as "<3>" or "<11>", the
+ * same prefix /dev/kmsg and syslog() accept. The facility part is ignored.
+ *
+ * Return: Severity from LOGLEVEL_EMERG to LOGLEVEL_DEBUG
+ */
+static u8 klog_parse_level(const char *msg) {
+    unsigned int prio = 0;
+    int i;
+
+    if (msg[0] != '<') {
+        return LOGLEVEL_INFO;
+    }
+    for (i = 1; i <= 3 && isdigit(msg[i]); i++) {
+        prio = prio * 10 + (msg[i] - '0');
+    }
+    if (i == 1 || msg[i] != '>') {
+        return LOGLEVEL_INFO;
+    }
+
+    return prio & 7;
+}
+
+/**
+ * klog_ring_open() - Allocate the segment table of a ring channel
+ * @ch: New channel
+ * @quota: Bytes of message buffer the channel may use
+ *
+ * The buffer holds as many segments as fit in @quota, rounded down to a power
+ * of two, and up to burst times as many while consumers lag. The table has
+ * KLOG_SEG_SPAN entries per segment the buffer may hold, so history packed
+ * by compaction can span more than the memory it takes. Only the table is
+ * allocated here; segments are allocated by the writers that first reach
+ * them and charged to their memory cgroup.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+static int klog_ring_open(struct klog_channel *ch, size_t quota) {
+    ch->nr_entries = rounddown_pow_of_two(quota / KLOG_SEG_SIZE) * KLOG_SEG_ENTRIES;
+    ch->max_entries = ch->nr_entries * burst;
+    ch->nr_segs = ch->max_entries / KLOG_SEG_ENTRIES * KLOG_SEG_SPAN;
+    ch->segs = kvcalloc(ch->nr_segs, sizeof(*ch->segs), GFP_KERNEL_ACCOUNT);
+
+    return ch->segs ? 0 : -ENOMEM;
+}
+
+/**
+ * klog_ring_close() - Free the segments of a ring channel
+ * @ch: Channel nothing refers to any more
+ */
+static void klog_ring_close(struct klog_channel *ch) {
+    unsigned int i;
+
+    for (i = 0; i < ch->nr_segs; i++) {
+        klog_seg_put(rcu_dereference_protected(ch->segs[i], 1));
+    }
+    klog_seg_put(ch->spare);
+    kvfree(ch->segs);
+}
+
+/**
+ * klog_ring_write() - Write a message at the head of the ring
+ * @ch: Ring channel
+ * @filep: File written to, or NULL for a message from a BPF program
+ * @msg: Text of the message
+ * @len: Length of @msg, less than MSG_LEN
+ * @tmpl: Time, level and pid of the message; the writer slot is filled in
+ *
+ * A message starting a segment on a full buffer evicts the oldest segment,
+ * unless a retaining consumer has not read it yet, in which case the writer
+ * waits for up to retain_ms. The message is published to lockless readers
+ * through the slot header and head_seq by klog_commit().
+ *
+ * In fair share mode a writer over its share of a full buffer has its
+ * message dropped with -ENOBUFS rather than evict another writer's.
+ * Messages from BPF programs are written by a worker on their behalf, so
+ * they never wait for retention and are not accounted to any writer.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_ring_write(struct klog_channel *ch, struct file *filep, const char *msg, size_t len,
+                           struct klog_hdr *tmpl) {
+    u64 writer_id = 0;
+    int writer = KLOG_NO_WRITER;
+    u64 seq;
+    int err;
+
+    if (filep && fair_share != KLOG_FAIR_OFF) {
+        writer_id = klog_writer_id();
+    }
+
+    spin_lock(&ch->lock);
+    err = klog_reserve(ch, filep, writer_id, filep ? &writer : NULL);
+    if (err) {
+        return err;
+    }
+    tmpl->writer = writer;
+    seq = klog_commit(ch, msg, len, tmpl);
+    spin_unlock(&ch->lock);  // Unlock after writing
+
+    klog_write_wake(ch, seq + 1);
+    return 0;
+}
+
+static const struct klog_backend klog_ring_backend = {
+    .name = "ring",
+    .open = klog_ring_open,
+    .close = klog_ring_close,
+    .write = klog_ring_write,
+};
+
+/**
+ * struct klog_framed - Message framed as a mux record
+ * @rec: Record header
+ * @text: Message text, padded with zeros to KLOG_RECORD_ALIGN
+ */
+struct klog_framed {
+    struct klog_record rec;
+    char text[ALIGN(MSG_LEN, KLOG_RECORD_ALIGN)];
+};
+
+/**
+ * klog_frame() - Frame a message for a relay or trace channel
+ * @ch: Relay or trace channel
+ * @buf: Out: framed message
+ * @msg: Text of the message
+ * @len: Length of @msg, less than MSG_LEN
+ * @tmpl: Time and level of the message
+ * @gseq: Global sequence number of the message, or 0 if it needs none
+ *
+ * The message is framed as a struct klog_record followed by its text padded
+ * to KLOG_RECORD_ALIGN, as the mux returns in record mode, so tools and
+ * KLOG_IOC_IMPORT read both alike. The record takes the next sequence
+ * number of the channel, the one counter its writers share.
+ *
+ * Return: Length of the framed message in bytes
+ */
+static size_t klog_frame(struct klog_channel *ch, struct klog_framed *buf, const char *msg, size_t len,
+                         const struct klog_hdr *tmpl, u64 gseq) {
+    size_t padded = ALIGN(len, KLOG_RECORD_ALIGN);
+
+    buf->rec = (struct klog_record){
+        .gseq = gseq,
+        .seq = atomic64_fetch_inc(&ch->rec_seq),
+        .ts_ns = tmpl->ts_ns,
+        .channel = ch->idx,
+        .len = len,
+        .level = tmpl->level,
+    };
+    memcpy(buf->text, msg, len);
+    memset(buf->text + len, 0, padded - len);
+
+    return sizeof(buf->rec) + padded;
+}
+
+/**
+ * klog_relay_create_file() - Create the debugfs file of one relay buffer
+ * @filename: Channel name followed by the CPU number
+ * @parent: klog.debugfs_dir
+ * @mode: Mode of the file
+ * @buf: Relay buffer of one CPU
+ * @is_global: Out: left alone, there is one buffer per CPU
+ *
+ * Return: New dentry, or an error pointer
+ */
+static struct dentry *klog_relay_create_file(const char *filename, struct dentry *parent, umode_t mode,
+                                             struct rchan_buf *buf, int *is_global) {
+    return debugfs_create_file(filename, mode, parent, buf, &relay_file_operations);
+}
+
+/**
+ * klog_relay_remove_file() - Remove the debugfs file of one relay buffer
+ * @dentry: File created by klog_relay_create_file()
+ *
+ * Return: Always 0
+ */
+static int klog_relay_remove_file(struct dentry *dentry) {
+    debugfs_remove(dentry);
+    return 0;
+}
+
+/**
+ * klog_relay_subbuf_start() - Let a full relay buffer overwrite its oldest messages
+ * @buf: Relay buffer of one CPU
+ * @subbuf: Sub-buffer about to be written
+ * @prev_subbuf: Sub-buffer just filled
+ * @prev_padding: Unused bytes at the end of @prev_subbuf
+ *
+ * Relay channels behave like the ring: the newest messages win, as in the
+ * relay flight recorder mode.
+ *
+ * Return: Always 1, to switch to @subbuf
+ */
+static int klog_relay_subbuf_start(struct rchan_buf *buf, void *subbuf, void *prev_subbuf, size_t prev_padding) {
+    return 1;
+}
+
+static const struct rchan_callbacks klog_relay_cb = {
+    .subbuf_start = klog_relay_subbuf_start,
+    .create_buf_file = klog_relay_create_file,
+    .remove_buf_file = klog_relay_remove_file,
+};
+
+/**
+ * klog_relay_open() - Allocate the relay buffers of a relay channel
+ * @ch: New channel
+ * @quota: Bytes of relay buffer the channel may use, across every CPU
+ *
+ * The quota is shared between the possible CPUs, in sub-buffers of whole
+ * pages and at least one page each, so a machine with many CPUs and a
+ * small quota gets a little more. The relay buffers are not charged to a
+ * memory cgroup. They show up in klog.debugfs_dir as <name><cpu>.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+static int klog_relay_open(struct klog_channel *ch, size_t quota) {
+    size_t subbuf = rounddown(quota / num_possible_cpus() / KLOG_RELAY_SUBBUFS, PAGE_SIZE);
+
+    ch->relay = relay_open(ch->name, klog.debugfs_dir, max_t(size_t, subbuf, PAGE_SIZE),
+                           KLOG_RELAY_SUBBUFS, &klog_relay_cb, ch);
+
+    return ch->relay ? 0 : -ENOMEM;
+}
+
+/**
+ * klog_relay_close() - Free the relay buffers of a relay channel
+ * @ch: Channel nothing refers to any more
+ */
+static void klog_relay_close(struct klog_channel *ch) {
+    relay_close(ch->relay);
+}
+
+/**
+ * klog_relay_write() - Write a message to the relay buffer of the current CPU
+ * @ch: Relay channel
+ * @filep: Unused
+ * @msg: Text of the message
+ * @len: Length of @msg, less than MSG_LEN
+ * @tmpl: Time and level of the message
+ *
+ * No channel lock is taken; relay_write() only disables interrupts on the
+ * local CPU.
+ *
+ * Return: Always 0
+ */
+static int klog_relay_write(struct klog_channel *ch, struct file *filep, const char *msg, size_t len,
+                            struct klog_hdr *tmpl) {
+    struct klog_framed buf;
+
+    relay_write(ch->relay, &buf, klog_frame(ch, &buf, msg, len, tmpl, atomic64_fetch_inc(&klog.gseq)));
+    return 0;
+}
+
+/**
+ * klog_relay_read() - Read a relay channel from its device
+ * @ch: Relay channel
+ * @iocb: Unused
+ * @to: Unused
+ *
+ * The messages of a relay channel are read from its debugfs files.
+ *
+ * Return: Always 0, end of file
+ */
+static ssize_t klog_relay_read(struct klog_channel *ch, struct kiocb *iocb, struct iov_iter *to) {
+    return 0;
+}
+
+static const struct klog_backend klog_relay_backend = {
+    .name = "relay",
+    .open = klog_relay_open,
+    .close = klog_relay_close,
+    .write = klog_relay_write,
+    .read = klog_relay_read,
+};
+
+/**
+ * klog_trace_open() - Allocate the tracing ring buffer of a trace channel
+ * @ch: New channel
+ * @quota: Bytes of ring buffer the channel may use, across every CPU
+ *
+ * The quota is shared between the possible CPUs, at least two pages each
+ * as the ring buffer needs, and is not charged to a memory cgroup. The
+ * buffer overwrites its oldest events when full, like the ring.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+static int klog_trace_open(struct klog_channel *ch, size_t quota) {
+    size_t per_cpu = rounddown(quota / num_possible_cpus(), PAGE_SIZE);
+
+    mutex_init(&ch->trace_lock);
+    ch->trace = ring_buffer_alloc(max_t(size_t, per_cpu, 2 * PAGE_SIZE), RB_FL_OVERWRITE);
+
+    return ch->trace ? 0 : -ENOMEM;
+}
+
+/**
+ * klog_trace_close() - Free the tracing ring buffer of a trace channel
+ * @ch: Channel nothing refers to any more
+ */
+static void klog_trace_close(struct klog_channel *ch) {
+    ring_buffer_free(ch->trace);
+}
+
+/**
+ * klog_trace_write() - Write a message to the ring buffer of the current CPU
+ * @ch: Trace channel
+ * @filep: Unused
+ * @msg: Text of the message
+ * @len: Length of @msg, less than MSG_LEN
+ * @tmpl: Time and level of the message
+ *
+ * The event is the message framed by klog_frame(). ring_buffer_write() is
+ * lockless; it only fails when recording is disabled or it would recurse.
+ * Readers only see the texts, which no other channel is ordered against,
+ * so the event takes no global sequence number: the channel sequence
+ * number the merge orders by is the one cache line every CPU writing the
+ * channel shares. Per-CPU numbers would leave nothing to merge by, since
+ * neither the ring buffer clock nor the wall clock orders writes on
+ * different CPUs exactly.
+ *
+ * Return: 0 on success, -EBUSY if the event was not recorded
+ */
+static int klog_trace_write(struct klog_channel *ch, struct file *filep, const char *msg, size_t len,
+                            struct klog_hdr *tmpl) {
+    struct klog_framed buf;
+
+    return ring_buffer_write(ch->trace, klog_frame(ch, &buf, msg, len, tmpl, 0), &buf);
+}
+
+/**
+ * klog_trace_read() - Consume messages from a trace channel
+ * @ch: Trace channel
+ * @iocb: Unused, the channel has no position to seek to
+ * @to: Destination
+ *
+ * Merges the per-CPU buffers by channel sequence number, since the ring
+ * buffer's clock is not comparable across CPUs, and copies out the message
+ * texts back to back, as a ring read does. Reading consumes the messages,
+ * so readers share one position. A message is left in the buffer if it does
+ * not fit whole, unless it is the first one, which is then truncated. The
+ * reader page of each CPU belongs to the readers, so the event peeked at
+ * stays put until it is consumed.
+ *
+ * Return: Number of bytes read, 0 if the buffer is empty, or -EFAULT
+ */
+static ssize_t klog_trace_read(struct klog_channel *ch, struct kiocb *iocb, struct iov_iter *to) {
+    struct ring_buffer_event *event;
+    struct klog_record *rec = NULL;
+    struct klog_record *next;
+    ssize_t bytes_read = 0;
+    size_t len;
+    int cpu, first;
+
+    mutex_lock(&ch->trace_lock);
+    while (iov_iter_count(to)) {
+        first = -1;
+        for_each_possible_cpu(cpu) {
+            event = ring_buffer_peek(ch->trace, cpu, NULL, NULL);
+            if (!event) {
+                continue;
+            }
+            next = ring_buffer_event_data(event);
+            if (first < 0 || next->seq < rec->seq) {
+                first = cpu;
+                rec = next;
+            }
+        }
+        if (first < 0) {
+            break;
+        }
+
+        len = rec->len;
+        if (len > iov_iter_count(to)) {
+            if (bytes_read) {
+                break;
+            }
+            len = iov_iter_count(to);
+        }
+        if (copy_to_iter(rec + 1, len, to) != len) {
+            bytes_read = bytes_read ?: -EFAULT;
+            break;
+        }
+        ring_buffer_consume(ch->trace, first, NULL, NULL);
+        bytes_read += len;
+    }
+    mutex_unlock(&ch->trace_lock);
+
+    return bytes_read;
+}
+
+static const struct klog_backend klog_trace_backend = {
+    .name = "trace",
+    .open = klog_trace_open,
+    .close = klog_trace_close,
+    .write = klog_trace_write,
+    .read = klog_trace_read,
+};
+
+static const struct klog_backend *const klog_backends[] = {
+    &klog_ring_backend,
+    &klog_relay_backend,
+    &klog_trace_backend,
+};
+
+/**
+ * klog_backend_find() - Look a backend up by name
+ * @name: Name of the backend in the channels parameter
+ *
+ * Return: The backend, or NULL if there is none of that name
+ */
+static const struct klog_backend *klog_backend_find(const char *name) {
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(klog_backends); i++) {
+        if (!strcmp(klog_backends[i]->name, name)) {
+            return klog_backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * dev_write() - Write a message to the channel
+ * @filep: Pointer to the file object
+ * @user_buffer: Buffer in user space containing data to write
+ * @count: Number of bytes to write
+ * @file_pos: Current position in file
+ *
+ * The message is copied in from user space, time stamped and given its
+ * level before the channel's backend stores it, so no backend copies from
+ * user space under its own locks.
+ *
+ * Return: Number of bytes written, or negative error code on failure
+ */
+static ssize_t dev_write(struct file *filep, const char __user *user_buffer, size_t count, loff_t *file_pos) {
+    struct klog_channel *ch = ((struct klog_file *)filep->private_data)->ch;
+    struct klog_hdr tmpl = { .ts_ns = ktime_get_real_ns() };
+    size_t bytes_to_copy = count;
+    size_t usr_idx = 0;
+    char msg[MSG_LEN];
+    int err;
+
+    // If incoming data is larger than the buffer, truncate to keep only the latest part
+    if (count >= MSG_LEN) {
+        usr_idx = count - (MSG_LEN - 1);
+        bytes_to_copy = MSG_LEN - 1;
+    }
+
+    if (copy_from_user(msg, user_buffer + usr_idx, bytes_to_copy)) {
+        return -EFAULT;
+    }
+    msg[bytes_to_copy] = '\0';
+    tmpl.level = klog_parse_level(msg);
+    tmpl.pid = task_tgid_nr(current);
+
+    err = ch->backend->write(ch, filep, msg, bytes_to_copy, &tmpl);
+    if (err) {
+        return err;
+    }
+
+    return count; // Return number of bytes written
+}
+
+/**
+ * mux_open() - Open the mux device
+ * @inodep: Pointer to the inode object
+ * @filep: Pointer to the file object
+ *
+ * The reader starts subscribed to every channel, at the oldest message of
+ * each. The mux has no position of its own to seek to, so the file is a
+ * stream.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int mux_open(struct inode *inodep, struct file *filep) {
+    struct klog_mux *mux;
+    unsigned int i;
+
+    mux = kzalloc(sizeof(*mux), GFP_KERNEL_ACCOUNT);
+    if (!mux) {
+        return -ENOMEM;
+    }
+    mutex_init(&mux->lock);
+    mux->subs = BIT(klog.nr_channels) - 1;
+    for (i = 0; i < KLOG_MAX_CHANNELS; i++) {
+        mux->src[i].len = -ENODATA;
+    }
+    filep->private_data = mux;
+    stream_open(inodep, filep);
+
+    atomic_inc(&klog.open_count);
+    return 0;
+}
+
+/**
+ * mux_release() - Close the mux device
+ * @inodep: Pointer to the inode object
+ * @filep: Pointer to the file object
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int mux_release(struct inode *inodep, struct file *filep) {
+    kfree(filep->private_data);
+
+    // Check for underflow before decrementing
+    if (atomic_read(&klog.open_count) <= 0) {
+        printk(KERN_WARNING "klogger: Device close called but no open handles\n");
+        return -EINVAL;
+    }
+    atomic_dec(&klog.open_count);
+    return 0;
+}
+
+/**
+ * klog_mux_fill() - Make sure a channel holds its next message for the merge
+ * @mux: Merge state of the reader
+ * @i: Index of the channel
+ *
+ * Messages numbered below what the reader already got are skipped, so a
+ * channel subscribed to midway cannot take the merge back in time.
+ */
+static void klog_mux_fill(struct klog_mux *mux, unsigned int i) {
+    struct klog_mux_src *src = &mux->src[i];
+
+    while (src->len < 0 || src->hdr.gseq < mux->gseq) {
+        if (src->len >= 0) {
+            src->seq++;
+        }
+        src->len = klog_fetch(klog.channels[i], &src->seq, src->msg, &src->hdr);
+        if (src->len < 0) {
+            return;
+        }
+    }
+}
+
+/**
+ * klog_mux_next() - Pick the next message of a mux reader
+ * @mux: Merge state of the reader
+ *
+ * A k-way merge on the global sequence number: every channel is already
+ * ordered by it, so only the next unread message of each subscribed channel
+ * needs to be compared, and the smallest goes first. Messages are fetched
+ * once and held until they win.
+ *
+ * A channel with nothing to contribute may be in the middle of a write that
+ * took a smaller number than the pick. The reader then waits for that write
+ * to be published, a few stores under the channel lock, and merges again.
+ *
+ * Return: Index of the channel whose message goes next, or -1 if none
+ */
+static int klog_mux_next(struct klog_mux *mux) {
+    struct klog_channel *ch;
+    unsigned int i;
+    int best;
+
+retry:
+    best = -1;
+    for_each_set_bit(i, &mux->subs, klog.nr_channels) {
+        klog_mux_fill(mux, i);
+        if (mux->src[i].len >= 0 &&
+            (best < 0 || mux->src[i].hdr.gseq < mux->src[best].hdr.gseq)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        return -1;
+    }
+
+    for_each_set_bit(i, &mux->subs, klog.nr_channels) {
+        ch = klog.channels[i];
+        if (mux->src[i].len >= 0) {
+            continue;
+        }
+        if (smp_load_acquire(&ch->writing)) {
+            while (smp_load_acquire(&ch->writing)) {
+                cpu_relax();
+            }
+            goto retry;
+        }
+        // Published since it was fetched
+        if (mux->src[i].seq < smp_load_acquire(&ch->head_seq)) {
+            goto retry;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * klog_mux_copy_record() - Copy one message to a mux reader in record mode
+ * @src: Merge state holding the message
+ * @i: Index of the channel of the message
+ * @to: Destination iterator in user space
+ *
+ * Return: Number of bytes copied, 0 if the record does not fit in @to,
+ * or -EFAULT
+ */
+static ssize_t klog_mux_copy_record(struct klog_mux_src *src, unsigned int i, struct iov_iter *to) {
+    static const char zeros[KLOG_RECORD_ALIGN];
+    struct klog_record rec = {
+        .gseq = src->hdr.gseq,
+        .seq = src->seq,
+        .ts_ns = src->hdr.ts_ns,
+        .channel = i,
+        .len = src->len,
+        .level = src->hdr.level,
+    };
+    size_t pad = ALIGN(src->len, KLOG_RECORD_ALIGN) - src->len;
+    size_t total = sizeof(rec) + src->len + pad;
+
+    if (total > iov_iter_count(to)) {
+        return 0;
+    }
+    if (copy_to_iter(&rec, sizeof(rec), to) != sizeof(rec) ||
+        copy_to_iter(src->msg, src->len, to) != src->len ||
+        copy_to_iter(zeros, pad, to) != pad) {
+        return -EFAULT;
+    }
+
+    return total;
+}
+
+/**
+ * mux_read_iter() - Read the subscribed channels merged in global order
+ * @iocb: I/O control block
+ * @to: Destination iterator in user space
+ *
+ * One read returns as many messages as fit, in the order they were written
+ * across the subscribed channels. As plain text they come back to back like
+ * a plain read() of a channel. In record mode each one is a struct
+ * klog_record tagged with its channel, followed by the text; a buffer too
+ * small for the first record gets -EINVAL rather than a truncated record.
+ *
+ * Return: Number of bytes read, or negative error code on failure
+ */
+static ssize_t mux_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct klog_mux *mux = iocb->ki_filp->private_data;
+    struct klog_mux_src *src;
+    ssize_t bytes_read = 0;
+    ssize_t len;
+    int i;
+
+    mutex_lock(&mux->lock);
+
+    while (iov_iter_count(to)) {
+        i = klog_mux_next(mux);
+        if (i < 0) {
+            break;
+        }
+
+        src = &mux->src[i];
+        if (mux->records) {
+            len = klog_mux_copy_record(src, i, to);
+            if (!len) {
+                if (!bytes_read) {
+                    bytes_read = -EINVAL;
+                }
+                break;
+            }
+        } else {
+            len = min_t(size_t, src->len, iov_iter_count(to));
+            // Never split a message across two reads
+            if (len < src->len && bytes_read) {
+                break;
+            }
+            if (copy_to_iter(src->msg, len, to) != len) {
+                len = -EFAULT;
+            }
+        }
+        if (len < 0) {
+            if (!bytes_read) {
+                bytes_read = len;
+            }
+            break;
+        }
+
+        bytes_read += len;
+        mux->gseq = src->hdr.gseq + 1;
+        src->seq++;
+        src->len = -ENODATA;
+    }
+
+    mutex_unlock(&mux->lock);
+
+    return bytes_read;
+}
+
+/**
+ * mux_poll() - Report whether any subscribed channel has unread messages
+ * @filep: Pointer to the file object
+ * @wait: Poll table
+ *
+ * The file waits on every subscribed channel at once, so a collector needs
+ * one descriptor in its event loop however many channels it reads.
+ *
+ * Return: POLLIN if a subscribed channel has messages this file has not read
+ */
+static __poll_t mux_poll(struct file *filep, poll_table *wait) {
+    struct klog_mux *mux = filep->private_data;
+    unsigned long subs = READ_ONCE(mux->subs);
+    struct klog_channel *ch;
+    __poll_t mask = 0;
+    unsigned int i;
+
+    for_each_set_bit(i, &subs, klog.nr_channels) {
+        ch = klog.channels[i];
+        poll_wait(filep, &ch->poll_wait, wait);
+        if (READ_ONCE(mux->src[i].len) >= 0 ||
+            READ_ONCE(mux->src[i].seq) < smp_load_acquire(&ch->head_seq)) {
+            mask |= EPOLLIN | EPOLLRDNORM;
+        }
+    }
+
+    return mask;
+}
+
+/**
+ * klog_mux_subscribe() - Add or remove a channel of a mux reader
+ * @mux: Merge state of the reader
+ * @cmd: KLOG_IOC_MUX_SUBSCRIBE or KLOG_IOC_MUX_UNSUBSCRIBE
+ * @usub: User space request naming the channel
+ *
+ * A channel keeps its position in the file while unsubscribed, and resumes
+ * from there, skipping what is older than the last message read.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_mux_subscribe(struct klog_mux *mux, unsigned int cmd, struct klog_mux_sub __user *usub) {
+    struct klog_mux_sub sub;
+    unsigned int i;
+
+    if (copy_from_user(&sub, usub, sizeof(sub))) {
+        return -EFAULT;
+    }
+    if (sub.pad || strnlen(sub.name, sizeof(sub.name)) >= sizeof(sub.name)) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        if (!strcmp(klog.channels[i]->name, sub.name)) {
+            break;
+        }
+    }
+    if (i == klog.nr_channels) {
+        return -ENOENT;
+    }
+
+    mutex_lock(&mux->lock);
+    if (cmd == KLOG_IOC_MUX_SUBSCRIBE) {
+        if (!mux->narrowed) {
+            mux->subs = 0;
+            mux->narrowed = true;
+        }
+        WRITE_ONCE(mux->subs, mux->subs | BIT(i));
+    } else {
+        WRITE_ONCE(mux->subs, mux->subs & ~BIT(i));
+    }
+    mutex_unlock(&mux->lock);
+
+    sub.channel = i;
+    if (cmd == KLOG_IOC_MUX_SUBSCRIBE && copy_to_user(usub, &sub, sizeof(sub))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/**
+ * mux_ioctl() - Handle control requests on the mux device
+ * @filep: Pointer to the file object
+ * @cmd: One of the KLOG_IOC_MUX_* commands from klogger.h
+ * @arg: Command argument
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static long mux_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    struct klog_mux *mux = filep->private_data;
+
+    switch (cmd) {
+    case KLOG_IOC_MUX_SUBSCRIBE:
+    case KLOG_IOC_MUX_UNSUBSCRIBE:
+        return klog_mux_subscribe(mux, cmd, (struct klog_mux_sub __user *)arg);
+    case KLOG_IOC_MUX_RECORDS:
+        mutex_lock(&mux->lock);
+        mux->records = true;
+        mutex_unlock(&mux->lock);
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * klog_seq_fetch() - Load the message at or after a seq_file position
+ * @iter: Iterator state of the /proc file
+ * @pos: seq_file position, which is the sequence number of the message
+ *
+ * Return: @iter if a message was loaded, or NULL at the end of the buffer
+ */
+static void *klog_seq_fetch(struct klog_seq_iter *iter, loff_t *pos) {
+    iter->seq = *pos;
+    iter->len = klog_fetch(iter->ch, &iter->seq, iter->msg, NULL);
+    if (iter->len < 0) {
+        return NULL;
+    }
+    *pos = iter->seq;
+    return iter;
+}
+
+/**
+ * klog_seq_start() - Start or resume a /proc dump at a sequence number
+ * @m: seq_file of the dump
+ * @pos: Sequence number to resume at
+ *
+ * Messages overwritten since the previous read are skipped. The channel is
+ * the data of the /proc entry.
+ *
+ * Return: Iterator for the first message, or NULL if there is none
+ */
+static void *klog_seq_start(struct seq_file *m, loff_t *pos) {
+    struct klog_seq_iter *iter = m->private;
+
+    iter->ch = pde_data(file_inode(m->file));
+    return klog_seq_fetch(iter, pos);
+}
+
+/**
+ * klog_seq_next() - Advance a /proc dump to the next message
+ * @m: seq_file of the dump
+ * @v: Iterator returned by the previous call
+ * @pos: Sequence number of the current message, advanced past it
+ *
+ * Return: Iterator for the next message, or NULL if there is none
+ */
+static void *klog_seq_next(struct seq_file *m, void *v, loff_t *pos) {
+    ++*pos;
+    return klog_seq_fetch(v, pos);
+}
+
+/**
+ * klog_seq_show() - Emit the current message of a /proc dump
+ * @m: seq_file of the dump
+ * @v: Iterator holding the message
+ *
+ * Return: Always 0
+ */
+static int klog_seq_show(struct seq_file *m, void *v) {
+    struct klog_seq_iter *iter = v;
+
+    seq_write(m, iter->msg, iter->len);
+    return 0;
+}
+
+/**
+ * klog_seq_stop() - End one chunk of a /proc dump
+ * @m: seq_file of the dump
+ * @v: Last iterator returned, or NULL
+ *
+ * Nothing is held between start and stop, readers are lockless.
+ */
+static void klog_seq_stop(struct seq_file *m, void *v) {
+}
+
+/* Iterator over the messages of a channel, keyed by sequence number */
+static const struct seq_operations klog_seq_ops = {
+    .start = klog_seq_start,
+    .next = klog_seq_next,
+    .stop = klog_seq_stop,
+    .show = klog_seq_show,
+};
+
+/**
+ * klogfs_minute() - Get the minute a timestamp falls in
+ * @ts_ns: Wall clock time in ns
+ *
+ * Return: Minutes since the epoch
+ */
+static inline u64 klogfs_minute(u64 ts_ns) {
+    return div_u64(div_u64(ts_ns, NSEC_PER_SEC), 60);
+}
+
+/**
+ * klogfs_minute_seq() - Find the first message of a minute
+ * @ch: Channel to search
+ * @minute: Minutes since the epoch
+ *
+ * Return: Sequence number of the first message written during or after @minute
+ */
+static inline u64 klogfs_minute_seq(struct klog_channel *ch, u64 minute) {
+    return klog_seq_at_time(ch, minute * 60 * NSEC_PER_SEC);
+}
+
+/**
+ * klogfs_slice_name() - Format the file name of a minute slice
+ * @buf: Destination buffer of KLOGFS_SLICE_NAME_LEN bytes
+ * @minute: Minutes since the epoch
+ *
+ * Return: Length of the name
+ */
+static int klogfs_slice_name(char *buf, u64 minute) {
+    struct tm tm;
+
+    time64_to_tm(minute * 60, 0, &tm);
+    return scnprintf(buf, KLOGFS_SLICE_NAME_LEN, "%04ld-%02d-%02dT%02d:%02d",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+}
+
+/**
+ * klogfs_parse_slice() - Parse the file name of a minute slice
+ * @name: File name such as "2026-10-15T12:03", in UTC
+ * @minute: Out: minutes since the epoch
+ *
+ * Return: 0 on success, -ENOENT if @name is not a valid slice name
+ */
+static int klogfs_parse_slice(const char *name, u64 *minute) {
+    char check[KLOGFS_SLICE_NAME_LEN];
+    unsigned int year, mon, day, hour, min;
+
+    if (sscanf(name, "%4u-%2u-%2uT%2u:%2u", &year, &mon, &day, &hour, &min) != 5 ||
+        year < 1970) {
+        return -ENOENT;
+    }
+    *minute = div_u64(mktime64(year, mon, day, hour, min, 0), 60);
+
+    // Only accept the canonical spelling, which also rejects 2026-02-31T25:99
+    klogfs_slice_name(check, *minute);
+    if (strcmp(check, name)) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+/**
+ * klogfs_range() - Get the messages a klogfs file covers right now
+ * @view: i_private of the file, its kind, channel and minute
+ * @start: Out: sequence number of the first message of the file
+ * @end: Out: sequence number one past the last message of the file
+ */
+static void klogfs_range(unsigned long view, u64 *start, u64 *end) {
+    struct klog_channel *ch = klog.channels[KLOGFS_VIEW_CHANNEL(view)];
+    u64 head = smp_load_acquire(&ch->head_seq);
+
+    switch (KLOGFS_VIEW_KIND(view)) {
+    case KLOGFS_LATEST_FILE:
+        *start = head > KLOGFS_LATEST ? head - KLOGFS_LATEST : 0;
+        *end = head;
+        break;
+    case KLOGFS_ERRORS_FILE:
+        *start = klog_first_seq(ch);
+        *end = head;
+        break;
+    case KLOGFS_SLICE_FILE:
+        *start = klogfs_minute_seq(ch, KLOGFS_VIEW_MINUTE(view));
+        *end = klogfs_minute_seq(ch, KLOGFS_VIEW_MINUTE(view) + 1);
+        break;
+    }
+}
+
+/**
+ * klogfs_count() - Count the bytes some messages of a klogfs file read as
+ * @ch: Channel the file shows
+ * @kind: Which messages the file shows
+ * @start: Sequence number to count from
+ * @end: Sequence number to count up to
+ *
+ * Return: Length of the messages in bytes
+ */
+static loff_t klogfs_count(struct klog_channel *ch, enum klogfs_kind kind, u64 start, u64 end) {
+    struct klog_hdr hdr;
+    char msg[MSG_LEN];
+    loff_t size = 0;
+    ssize_t len;
+    u64 seq;
+
+    for (seq = start; seq < end; seq++) {
+        len = klog_fetch(ch, &seq, msg, &hdr);
+        if (len < 0 || seq >= end) {
+            break;
+        }
+        if (kind != KLOGFS_ERRORS_FILE || hdr.level <= LOGLEVEL_ERR) {
+            size += len;
+        }
+    }
+
+    return size;
+}
+
+/**
+ * klogfs_size() - Get the bytes a klogfs file would read right now
+ * @node: i_private of the file
+ *
+ * The size is cached with the range it was counted over. While the range
+ * only grows at its end, only the new messages are counted, so a stat()
+ * costs nothing when nothing was written and the messages written since
+ * the last one otherwise. The whole range is counted again once its start
+ * moves, for instance when the oldest segment is evicted, or once a
+ * message of the channel is purged.
+ *
+ * Return: Length of the file in bytes
+ */
+static loff_t klogfs_size(struct klogfs_node *node) {
+    struct klog_channel *ch = klog.channels[KLOGFS_VIEW_CHANNEL(node->view)];
+    u64 nr_purges = READ_ONCE(ch->nr_purges);
+    u64 start, end;
+    loff_t size;
+
+    klogfs_range(node->view, &start, &end);
+
+    mutex_lock(&node->lock);
+    if (start != node->start || end < node->end || nr_purges != node->nr_purges) {
+        node->start = start;
+        node->end = start;
+        node->nr_purges = nr_purges;
+        node->size = 0;
+    }
+    node->size += klogfs_count(ch, KLOGFS_VIEW_KIND(node->view), node->end, end);
+    node->end = end;
+    size = node->size;
+    mutex_unlock(&node->lock);
+
+    return size;
+}
+
+/**
+ * klogfs_open() - Open a klogfs channel file
+ * @inodep: Inode of the file, i_private is its struct klogfs_node
+ * @filep: Pointer to the file object
+ *
+ * The range of messages the file covers is fixed at open, so a file keeps
+ * the same content while it is read even if new messages arrive.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klogfs_open(struct inode *inodep, struct file *filep) {
+    struct klogfs_node *node = inodep->i_private;
+    struct klogfs_cursor *cur;
+
+    cur = kzalloc(sizeof(*cur), GFP_KERNEL_ACCOUNT);
+    if (!cur) {
+        return -ENOMEM;
+    }
+    cur->ch = klog.channels[KLOGFS_VIEW_CHANNEL(node->view)];
+    mutex_init(&cur->lock);
+    cur->kind = KLOGFS_VIEW_KIND(node->view);
+    klogfs_range(node->view, &cur->start, &cur->end);
+    cur->seq = cur->start;
+
+    // One mark per segment start in the range, and one for the range start
+    cur->max_marks = DIV_ROUND_UP(cur->end - cur->start, KLOG_SEG_ENTRIES) + 1;
+    cur->marks = kvcalloc(cur->max_marks, sizeof(*cur->marks), GFP_KERNEL_ACCOUNT);
+    if (!cur->marks) {
+        kfree(cur);
+        return -ENOMEM;
+    }
+
+    filep->private_data = cur;
+    return 0;
+}
+
+/**
+ * klogfs_release() - Close a klogfs channel file
+ * @inodep: Pointer to the inode object
+ * @filep: Pointer to the file object
+ *
+ * Return: Always 0
+ */
+static int klogfs_release(struct inode *inodep, struct file *filep) {
+    struct klogfs_cursor *cur = filep->private_data;
+
+    kvfree(cur->marks);
+    kfree(cur);
+    return 0;
+}
+
+/**
+ * klogfs_seek_mark() - Move a cursor back to the last mark before an offset
+ * @cur: Cursor of the file, with its lock held
+ * @pos: Byte offset the read starts at, before the cursor
+ */
+static void klogfs_seek_mark(struct klogfs_cursor *cur, loff_t pos) {
+    unsigned int lo = 0;
+    unsigned int hi = cur->nr_marks;
+    unsigned int mid;
+
+    // Find the last mark at or before pos, the first one is the range start
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (cur->marks[mid].pos <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (cur->nr_marks) {
+        cur->seq = cur->marks[lo].seq;
+        cur->pos = cur->marks[lo].pos;
+    } else {
+        cur->seq = cur->start;
+        cur->pos = 0;
+    }
+}
+
+/**
+ * klogfs_read_iter() - Read a klogfs channel file
+ * @iocb: I/O control block; ki_pos is a byte offset in the file
+ * @to: Destination iterator in user space
+ *
+ * Unlike /dev/klogger, these files use byte offsets so that grep, less and
+ * rsync can use them like any text file. The cursor remembers where the
+ * last read stopped, so sequential reads never rescan earlier messages,
+ * and where it was at each segment start it went past, so a backwards
+ * seek or pread() restarts from the segment holding the offset rather
+ * than from the first message of the file.
+ *
+ * Return: Number of bytes read, or negative error code on failure
+ */
+static ssize_t klogfs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct klogfs_cursor *cur = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    struct klog_hdr hdr;
+    char msg[MSG_LEN];
+    ssize_t bytes_read = 0;
+    bool fault = false;
+    size_t off, n;
+    ssize_t len;
+    u64 seq;
+
+    mutex_lock(&cur->lock);
+
+    if (pos < cur->pos) {
+        klogfs_seek_mark(cur, pos);
+    }
+
+    while (iov_iter_count(to)) {
+        // Mark the range start, then the first point past each segment start
+        if (cur->nr_marks < cur->max_marks &&
+            (!cur->nr_marks || cur->seq >= cur->marks[cur->nr_marks - 1].seq -
+                                           klog_seg_off(cur->marks[cur->nr_marks - 1].seq) +
+                                           KLOG_SEG_ENTRIES)) {
+            cur->marks[cur->nr_marks].seq = cur->seq;
+            cur->marks[cur->nr_marks].pos = cur->pos;
+            cur->nr_marks++;
+        }
+
+        seq = cur->seq;
+        len = klog_fetch(cur->ch, &seq, msg, &hdr);
+        if (len < 0 || seq >= cur->end) {
+            break;
+        }
+
+        if (cur->kind == KLOGFS_ERRORS_FILE && hdr.level > LOGLEVEL_ERR) {
+            cur->seq = seq + 1;
+            continue;
+        }
+
+        // Skip whole messages until the one containing pos
+        if (pos < cur->pos + len) {
+            off = pos - cur->pos;
+            n = copy_to_iter(msg + off, len - off, to);
+            bytes_read += n;
+            pos += n;
+            if (n < len - off) {
+                fault = iov_iter_count(to) != 0;
+                break;
+            }
+        }
+
+        cur->pos += len;
+        cur->seq = seq + 1;
+    }
+
+    mutex_unlock(&cur->lock);
+
+    iocb->ki_pos = pos;
+    return (fault && !bytes_read) ? -EFAULT : bytes_read;
+}
+
+/**
+ * klogfs_getattr() - Get the attributes of a klogfs file
+ * @idmap: Idmap of the mount
+ * @path: Path of the file
+ * @stat: Out: attributes
+ * @request_mask: Attributes the caller wants
+ * @query_flags: AT_STATX_* flags
+ *
+ * The size is that of the content the file would show if opened now, so
+ * rsync and other tools that size a copy from stat() see the whole file.
+ *
+ * Return: Always 0
+ */
+static int klogfs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat,
+                          u32 request_mask, unsigned int query_flags) {
+    struct inode *inode = d_inode(path->dentry);
+
+    generic_fillattr(idmap, request_mask, inode, stat);
+    stat->size = klogfs_size(inode->i_private);
+    return 0;
+}
+
+/* Attributes of the files of a klogfs channel directory */
+static const struct inode_operations klogfs_file_iops = {
+    .getattr = klogfs_getattr,
+};
+
+/* Operations on the files of a klogfs channel directory */
+static const struct file_operations klogfs_file_fops = {
+    .owner = THIS_MODULE,
+    .open = klogfs_open,
+    .read_iter = klogfs_read_iter,
+    .llseek = default_llseek,
+    .release = klogfs_release,
+};
+
+/**
+ * klogfs_new_inode() - Allocate a klogfs inode
+ * @sb: Superblock of the klogfs mount
+ * @mode: File type and permissions
+ *
+ * Return: New inode, or NULL on allocation failure
+ */
+static struct inode *klogfs_new_inode(struct super_block *sb, umode_t mode) {
+    struct inode *inode = new_inode(sb);
+
+    if (inode) {
+        inode->i_ino = get_next_ino();
+        inode->i_mode = mode;
+        simple_inode_init_ts(inode);
+    }
+
+    return inode;
+}
+
+/**
+ * klogfs_lookup() - Resolve a file name in a channel directory
+ * @dir: Inode of the channel directory, i_private is the channel
+ * @dentry: Dentry being looked up
+ * @flags: Lookup flags
+ *
+ * Files are created on demand: "latest", "errors", and one file per minute
+ * that still has messages in the buffer. Neither misses nor hits are
+ * cached: a slice for the current minute may appear as soon as a message
+ * is written, and an old one disappears once its messages are evicted.
+ *
+ * Return: NULL or the dentry to use, or an error pointer
+ */
+static struct dentry *klogfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags) {
+    const char *name = (const char *)dentry->d_name.name;
+    struct klog_channel *ch = dir->i_private;
+    struct klogfs_node *node;
+    struct inode *inode;
+    unsigned long view;
+    u64 minute;
+
+    if (!strcmp(name, "latest")) {
+        view = KLOGFS_VIEW(0, ch->idx, KLOGFS_LATEST_FILE);
+    } else if (!strcmp(name, "errors")) {
+        view = KLOGFS_VIEW(0, ch->idx, KLOGFS_ERRORS_FILE);
+    } else if (!klogfs_parse_slice(name, &minute) &&
+               klogfs_minute_seq(ch, minute) < klogfs_minute_seq(ch, minute + 1)) {
+        view = KLOGFS_VIEW(minute, ch->idx, KLOGFS_SLICE_FILE);
+    } else {
+        return NULL;
+    }
+
+    node = kzalloc(sizeof(*node), GFP_KERNEL_ACCOUNT);
+    if (!node) {
+        return ERR_PTR(-ENOMEM);
+    }
+    node->view = view;
+    mutex_init(&node->lock);
+
+    inode = klogfs_new_inode(dir->i_sb, S_IFREG | 0444);
+    if (!inode) {
+        kfree(node);
+        return ERR_PTR(-ENOMEM);
+    }
+    inode->i_op = &klogfs_file_iops;
+    inode->i_fop = &klogfs_file_fops;
+    inode->i_private = node;
+    inode->i_size = klogfs_size(node);
+    // Drop the dentry on last use, so the next lookup checks the slice again
+    d_set_d_op(dentry, &simple_dentry_operations);
+
+    return d_splice_alias(inode, dentry);
+}
+
+/**
+ * klogfs_readdir() - List a channel directory
+ * @filep: Pointer to the file object of the directory
+ * @ctx: Directory context; past the fixed files, pos encodes the next minute
+ *
+ * Each minute slice is found with one binary search from the previous one,
+ * so listing costs one search per minute rather than a walk of the buffer.
+ *
+ * Return: Always 0
+ */
+static int klogfs_readdir(struct file *filep, struct dir_context *ctx) {
+    struct klog_channel *ch = file_inode(filep)->i_private;
+    char name[KLOGFS_SLICE_NAME_LEN];
+    u64 head = smp_load_acquire(&ch->head_seq);
+    u64 minute;
+    u64 seq;
+    u64 ts;
+    int len;
+
+    if (!dir_emit_dots(filep, ctx)) {
+        return 0;
+    }
+    if (ctx->pos == KLOGFS_POS_LATEST) {
+        if (!dir_emit(ctx, "latest", 6, KLOGFS_POS_LATEST, DT_REG)) {
+            return 0;
+        }
+        ctx->pos++;
+    }
+    if (ctx->pos == KLOGFS_POS_ERRORS) {
+        if (!dir_emit(ctx, "errors", 6, KLOGFS_POS_ERRORS, DT_REG)) {
+            return 0;
+        }
+        ctx->pos++;
+    }
+
+    seq = klogfs_minute_seq(ch, ctx->pos - KLOGFS_POS_SLICES);
+    while (seq < head) {
+        ts = klog_ts_at(ch, seq);
+        // Nothing left at or after seq in a compacted segment
+        if (ts == U64_MAX) {
+            seq = (klog_segno(seq) + 1) * KLOG_SEG_ENTRIES;
+            continue;
+        }
+        minute = klogfs_minute(ts);
+        len = klogfs_slice_name(name, minute);
+        if (!dir_emit(ctx, name, len, KLOGFS_POS_SLICES + minute, DT_REG)) {
+            return 0;
+        }
+        ctx->pos = KLOGFS_POS_SLICES + minute + 1;
+        seq = max(seq + 1, klogfs_minute_seq(ch, minute + 1));
+    }
+
+    return 0;
+}
+
+/* Operations on a klogfs channel directory */
+static const struct file_operations klogfs_dir_fops = {
+    .owner = THIS_MODULE,
+    .read = generic_read_dir,
+    .iterate_shared = klogfs_readdir,
+    .llseek = default_llseek,
+};
+
+/* Lookups in a klogfs channel directory */
+static const struct inode_operations klogfs_dir_iops = {
+    .lookup = klogfs_lookup,
+};
+
+/**
+ * klogfs_evict_inode() - Free a klogfs inode
+ * @inode: Inode being evicted
+ */
+static void klogfs_evict_inode(struct inode *inode) {
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    if (S_ISREG(inode->i_mode)) {
+        kfree(inode->i_private);
+    }
+}
+
+/* Superblock operations of klogfs, those of simple_fill_super() plus evict */
+static const struct super_operations klogfs_super_ops = {
+    .statfs = simple_statfs,
+    .drop_inode = generic_delete_inode,
+    .evict_inode = klogfs_evict_inode,
+};
+
+/**
+ * klogfs_fill_super() - Set up a klogfs mount
+ * @sb: Superblock to fill
+ * @fc: Filesystem context of the mount
+ *
+ * The root holds one directory per channel.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klogfs_fill_super(struct super_block *sb, struct fs_context *fc) {
+    static const struct tree_descr no_files[] = { { "" } };
+    struct dentry *dentry;
+    struct inode *inode;
+    unsigned int i;
+    int err;
+
+    err = simple_fill_super(sb, KLOGFS_MAGIC, no_files);
+    if (err) {
+        return err;
+    }
+    sb->s_op = &klogfs_super_ops;
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        inode = klogfs_new_inode(sb, S_IFDIR | 0555);
+        if (!inode) {
+            return -ENOMEM;
+        }
+        inode->i_op = &klogfs_dir_iops;
+        inode->i_fop = &klogfs_dir_fops;
+        inode->i_private = klog.channels[i];
+        set_nlink(inode, 2);
+
+        dentry = d_alloc_name(sb->s_root, klog.channels[i]->name);
+        if (!dentry) {
+            iput(inode);
+            return -ENOMEM;
+        }
+        d_add(dentry, inode);
+        inc_nlink(d_inode(sb->s_root));
+    }
+
+    return 0;
+}
+
+/**
+ * klogfs_get_tree() - Get the superblock of a klogfs mount
+ * @fc: Filesystem context of the mount
+ *
+ * All mounts share one superblock, there is only one set of channels.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klogfs_get_tree(struct fs_context *fc) {
+    return get_tree_single(fc, klogfs_fill_super);
+}
+
+static const struct fs_context_operations klogfs_context_ops = {
+    .get_tree = klogfs_get_tree,
+};
+
+/**
+ * klogfs_init_fs_context() - Prepare a klogfs mount
+ * @fc: Filesystem context of the mount
+ *
+ * Return: Always 0
+ */
+static int klogfs_init_fs_context(struct fs_context *fc) {
+    fc->ops = &klogfs_context_ops;
+    return 0;
+}
+
+/* Pseudo-filesystem exposing channels and time slices as files */
+static struct file_system_type klogfs_type = {
+    .owner = THIS_MODULE,
+    .name = KLOGFS_NAME,
+    .init_fs_context = klogfs_init_fs_context,
+    .kill_sb = kill_litter_super,
+};
+
+/**
+ * klog_channel_name_valid() - Check the name of a channel to create
+ * @name: NUL-terminated name from the channels parameter
+ *
+ * Names end up in /dev, /proc and klogfs, so they are kept to letters,
+ * digits, '_' and '-', and must not clash with another channel or the mux.
+ *
+ * Return: true if a channel may be created with this name
+ */
+static bool klog_channel_name_valid(const char *name) {
+    unsigned int i;
+
+    if (!name[0] || strlen(name) >= KLOG_CHANNEL_NAME_LEN || !strcmp(name, "mux")) {
+        return false;
+    }
+    for (i = 0; name[i]; i++) {
+        if (!isalnum(name[i]) && name[i] != '_' && name[i] != '-') {
+            return false;
+        }
+    }
+    for (i = 0; i < klog.nr_channels; i++) {
+        if (!strcmp(klog.channels[i]->name, name)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * klog_channel_free() - Free the memory of a channel
+ * @ch: Channel nothing refers to any more
+ */
+static void klog_channel_free(struct klog_channel *ch) {
+    if (ch->backend) {
+        ch->backend->close(ch);
+    }
+    kfree(ch);
+}
+
+/**
+ * klog_channel_create() - Create a channel with its device and /proc file
+ * @name: Name of the channel
+ * @quota: Bytes of message buffer the channel may use
+ * @backend: Storage to keep the messages in
+ *
+ * The first channel is the default one and gets /dev/klogger, the others
+ * get /dev/klogger-<name>. The channel index is the device minor. The
+ * channel is charged to the memory cgroup of the caller, its buffer as
+ * @backend decides.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_channel_create(const char *name, size_t quota, const struct klog_backend *backend) {
+    unsigned int idx = klog.nr_channels;
+    struct klog_channel *ch;
+    int err;
+
+    if (idx >= KLOG_MAX_CHANNELS) {
+        return -ENOSPC;
+    }
+
+    ch = kzalloc(sizeof(*ch), GFP_KERNEL_ACCOUNT);
+    if (!ch) {
+        return -ENOMEM;
+    }
+    strscpy(ch->name, name, sizeof(ch->name));
+    err = backend->open(ch, quota);
+    if (err) {
+        klog_channel_free(ch);
+        return err;
+    }
+    ch->backend = backend;
+    spin_lock_init(&ch->lock);
+    INIT_WORK(&ch->compact_work, klog_compact);
+    atomic_set(&ch->entries, 0);
+    INIT_LIST_HEAD(&ch->groups);
+    mutex_init(&ch->groups_lock);
+    atomic_set(&ch->retainers, 0);
+    init_waitqueue_head(&ch->retain_wait);
+    INIT_LIST_HEAD(&ch->notifiers);
+    mutex_init(&ch->notifiers_lock);
+    init_waitqueue_head(&ch->poll_wait);
+    ch->idx = idx;
+
+    // Put back what the previous load or boot left, before anyone can write
+    klog_adopt_pending(ch);
+
+    if (idx) {
+        ch->device = device_create(klog.device_class, NULL, MKDEV(klog.major_number, idx),
+                                   NULL, "%s-%s", DEVICE_NAME, name);
+    } else {
+        ch->device = device_create(klog.device_class, NULL, MKDEV(klog.major_number, idx),
+                                   NULL, DEVICE_NAME);
+    }
+    if (IS_ERR(ch->device)) {
+        err = PTR_ERR(ch->device);
+        klog_channel_free(ch);
+        return err;
+    }
+
+    // Expose the channel as /proc/klogger/<name>
+    if (!proc_create_seq_private(name, 0444, klog.proc_dir, &klog_seq_ops,
+                                 sizeof(struct klog_seq_iter), ch)) {
+        device_destroy(klog.device_class, MKDEV(klog.major_number, idx));
+        klog_channel_free(ch);
+        return -ENOMEM;
+    }
+
+    klog.channels[idx] = ch;
+    klog.nr_channels++;
+    return 0;
+}
+
+/**
+ * klog_channels_create() - Create the default channel and those asked for
+ *
+ * Each entry of the channels parameter is a name, optionally followed by
+ * ":" and the channel quota in bytes with a K, M or G suffix, for example
+ * "app:128K". Channels without a quota get LOG_BUF_LEN. A second ":"
+ * picks the backend, "ring", "relay" or "trace", for example
+ * "bulk:1M:relay" or "bulk::trace".
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int klog_channels_create(void) {
+    char *names, *p, *name, *spec, *backend, *end;
+    const struct klog_backend *be;
+    unsigned long long quota;
+    int err;
+
+    // Relay channels put their buffers in /sys/kernel/debug/klogger
+    klog.debugfs_dir = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    err = klog_channel_create(DEVICE_NAME, LOG_BUF_LEN, &klog_ring_backend);
+    if (err) {
+        return err;
+    }
+
+    names = kstrdup(channels, GFP_KERNEL);
+    if (!names) {
+        return -ENOMEM;
+    }
+
+    p = names;
+    while ((name = strsep(&p, ",")) != NULL) {
+        if (!name[0]) {
+            continue;
+        }
+
+        quota = LOG_BUF_LEN;
+        be = &klog_ring_backend;
+        spec = strchr(name, ':');
+        if (spec) {
+            *spec++ = '\0';
+            backend = strchr(spec, ':');
+            if (backend) {
+                *backend++ = '\0';
+                be = klog_backend_find(backend);
+                if (!be) {
+                    printk(KERN_ERR "klogger: invalid backend %s for channel %s\n", backend, name);
+                    err = -EINVAL;
+                    break;
+                }
+            }
+        }
+        if (spec && spec[0]) {
+            quota = memparse(spec, &end);
+            if (*end || quota < LOG_BUF_MIN || quota > LOG_BUF_MAX) {
+                printk(KERN_ERR "klogger: invalid quota %s for channel %s\n", spec, name);
+                err = -EINVAL;
+                break;
+            }
+        }
+
+        if (!klog_channel_name_valid(name)) {
+            printk(KERN_ERR "klogger: invalid channel name %s\n", name);
+            err = -EINVAL;
+            break;
+        }
+        err = klog_channel_create(name, quota, be);
+        if (err) {
+            break;
+        }
+    }
+
+    kfree(names);
+    return err;
+}
+
+/**
+ * klog_park() - Hand the buffers of every channel to klogger_park
+ *
+ * Called on unload, once nothing uses the channels any more. The segments
+ * holding messages are moved out of the channel tables as they are, along
+ * with what is needed to put them back, and klog_channel_free() then frees
+ * only the rest. Does nothing if klogger_park is not loaded.
+ */
+static void klog_park(void) {
+    void (*store)(struct klog_park *park) = symbol_get(klog_park_store);
+    struct klog_park_channel *pch;
+    struct klog_park_meta *meta;
+    struct klog_park *park;
+    struct klog_channel *ch;
+    struct klog_seg __rcu **slot;
+    struct klog_seg *prev;
+    struct klog_seg *seg;
+    unsigned int nr_slots = 0;
+    unsigned int i, j;
+    void **blocks;
+
+    if (!store) {
+        return;
+    }
+
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        cancel_work_sync(&ch->compact_work);
+        nr_slots += DIV_ROUND_UP(ch->head_seq - ch->first_seq, KLOG_SEG_ENTRIES);
+    }
+
+    park = kzalloc(sizeof(*park), GFP_KERNEL);
+    meta = kvzalloc(struct_size(meta, slots, nr_slots), GFP_KERNEL);
+    blocks = kvmalloc_array(nr_slots ?: 1, sizeof(*blocks), GFP_KERNEL);
+    if (!park || !meta || !blocks) {
+        printk(KERN_WARNING "klogger: no memory to park buffers, dropping them\n");
+        kvfree(blocks);
+        kvfree(meta);
+        kfree(park);
+        symbol_put(klog_park_store);
+        return;
+    }
+    park->version = KLOG_PARK_VERSION;
+    park->meta = meta;
+    park->blocks = blocks;
+    meta->gseq = atomic64_read(&klog.gseq);
+    meta->seg_size = sizeof(struct klog_seg);
+
+    nr_slots = 0;
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        if (ch->head_seq == ch->first_seq) {
+            continue;
+        }
+        pch = &meta->channels[meta->nr_channels++];
+        strscpy(pch->name, ch->name, sizeof(pch->name));
+        pch->first_seq = ch->first_seq;
+        pch->head_seq = ch->head_seq;
+        pch->last_ts = ch->last_ts;
+        pch->weight_sum = ch->weight_sum;
+        pch->nr_slots = DIV_ROUND_UP(ch->head_seq - ch->first_seq, KLOG_SEG_ENTRIES);
+        pch->slot = nr_slots;
+        memcpy(pch->writers, ch->writers, sizeof(pch->writers));
+
+        prev = NULL;
+        for (j = 0; j < pch->nr_slots; j++) {
+            slot = klog_seg_slot(ch, ch->first_seq + (u64)j * KLOG_SEG_ENTRIES);
+            seg = rcu_dereference_protected(*slot, 1);
+            if (seg != prev) {
+                park->blocks[park->nr_blocks++] = seg;
+            }
+            meta->slots[nr_slots++] = park->nr_blocks - 1;
+            RCU_INIT_POINTER(*slot, NULL);
+            prev = seg;
+        }
+    }
+
+    store(park);
+    symbol_put(klog_park_store);
+    printk(KERN_INFO "klogger: parked %u segment(s) of %u channel(s)\n",
+           park->nr_blocks, meta->nr_channels);
+}
+
+/**
+ * klog_adopt_channel() - Put the parked buffer of a channel back in place
+ * @ch: Channel just created, still empty
+ * @park: Parked buffers
+ * @pch: Parked state of the channel
+ *
+ * The segments are installed in the new table as they are. The buffer must
+ * fit the table of the new channel, so a channel reloaded with a smaller
+ * quota or burst starts empty instead, as does one that already adopted
+ * buffers from elsewhere.
+ *
+ * Return: true if the buffer was adopted
+ */
+static bool klog_adopt_channel(struct klog_channel *ch, struct klog_park *park,
+                               const struct klog_park_channel *pch) {
+    const struct klog_park_meta *meta = park->meta;
+    struct klog_seg *prev = NULL;
+    struct klog_seg *seg;
+    unsigned int i;
+    u32 block;
+
+    if (!klog_is_ring(ch) || pch->nr_slots > ch->nr_segs || ch->head_seq) {
+        return false;
+    }
+
+    spin_lock(&ch->lock);
+    for (i = 0; i < pch->nr_slots; i++) {
+        block = meta->slots[pch->slot + i];
+        seg = park->blocks[block] ?: prev;
+        park->blocks[block] = NULL;
+        if (seg != prev) {
+            ch->nr_alloc++;
+            ch->nr_live++;
+        }
+        rcu_assign_pointer(*klog_seg_slot(ch, pch->first_seq + (u64)i * KLOG_SEG_ENTRIES), seg);
+        prev = seg;
+    }
+    memcpy(ch->writers, pch->writers, sizeof(ch->writers));
+    ch->weight_sum = pch->weight_sum;
+    ch->last_ts = pch->last_ts;
+    ch->retire_seq = pch->head_seq;
+    atomic_set(&ch->entries, pch->head_seq - pch->first_seq);
+    smp_store_release(&ch->first_seq, pch->first_seq);
+    smp_store_release(&ch->head_seq, pch->head_seq);
+    spin_unlock(&ch->lock);
+
+    return true;
+}
+
+/**
+ * klog_park_drop() - Free buffers left over from an adoption
+ * @park: Buffers, with the adopted blocks set to NULL
+ */
+static void klog_park_drop(struct klog_park *park) {
+    unsigned int i;
+
+    for (i = 0; i < park->nr_blocks; i++) {
+        kvfree(park->blocks[i]);
+    }
+    kvfree(park->blocks);
+    kvfree(park->meta);
+    kfree(park);
+}
+
+/**
+ * struct klog_adoption - Buffers waiting for their channels to be created
+ * @park: Buffers of a previous load or boot, in the current layout, or NULL
+ * @from: Where they come from, for the log
+ * @adopted: Number of channels that took their buffer back so far
+ */
+struct klog_adoption {
+    struct klog_park *park;
+    const char *from;
+    unsigned int adopted;
+};
+
+/* The previous load through klogger_park, and the kernel before a kexec */
+static struct klog_adoption klog_adoptions[2];
+
+/**
+ * klog_adopt_hold() - Keep buffers until their channels are created
+ * @park: Buffers of a previous load or boot, in the current layout
+ * @from: Where they come from, for the log
+ *
+ * The global sequence is moved past theirs right away, so no message
+ * written after the load sorts before an adopted one in the mux.
+ */
+static void klog_adopt_hold(struct klog_park *park, const char *from) {
+    const struct klog_park_meta *meta = park->meta;
+    unsigned int i;
+
+    if (meta->nr_channels && atomic64_read(&klog.gseq) < meta->gseq) {
+        atomic64_set(&klog.gseq, meta->gseq);
+    }
+    for (i = 0; i < ARRAY_SIZE(klog_adoptions); i++) {
+        if (!klog_adoptions[i].park) {
+            klog_adoptions[i] = (struct klog_adoption){ .park = park, .from = from };
+            return;
+        }
+    }
+    klog_park_drop(park);
+}
+
+/**
+ * klog_adopt_pending() - Give a new channel its buffer back
+ * @ch: Channel just created, before its device exists
+ *
+ * Buffers are adopted by channel name. Called before the device is created
+ * so that no write can land in the channel first.
+ */
+static void klog_adopt_pending(struct klog_channel *ch) {
+    struct klog_adoption *a;
+    struct klog_park_meta *meta;
+    unsigned int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(klog_adoptions); i++) {
+        a = &klog_adoptions[i];
+        if (!a->park) {
+            continue;
+        }
+        meta = a->park->meta;
+        for (j = 0; j < meta->nr_channels; j++) {
+            if (!strcmp(meta->channels[j].name, ch->name)) {
+                a->adopted += klog_adopt_channel(ch, a->park, &meta->channels[j]);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * klog_adopt_finish() - Free the buffers no channel took back
+ *
+ * Called once every channel has been created, or failed to be.
+ */
+static void klog_adopt_finish(void) {
+    const struct klog_park_meta *meta;
+    struct klog_adoption *a;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(klog_adoptions); i++) {
+        a = &klog_adoptions[i];
+        if (!a->park) {
+            continue;
+        }
+        meta = a->park->meta;
+        printk(KERN_INFO "klogger: adopted the buffers of %u of %u channel(s) %s\n",
+               a->adopted, meta->nr_channels, a->from);
+        klog_park_drop(a->park);
+        a->park = NULL;
+    }
+}
+
+/**
+ * klog_adopt() - Take back the buffers parked by the previous load
+ *
+ * Called on load, before the channels are created; each channel adopts its
+ * buffer as it is created. Buffers are adopted without copying, unless they
+ * are from another version of the module. Does nothing if klogger_park is
+ * not loaded or holds nothing.
+ */
+static void klog_adopt(void) {
+    struct klog_park *(*take)(void) = symbol_get(klog_park_take);
+    struct klog_park_meta *meta;
+    struct klog_park *park;
+
+    if (!take) {
+        return;
+    }
+    park = take();
+    symbol_put(klog_park_take);
+    if (!park) {
+        return;
+    }
+
+    meta = park->meta;
+    if (park->version != KLOG_PARK_VERSION || meta->seg_size != sizeof(struct klog_seg)) {
+        printk(KERN_WARNING "klogger: parked buffers are from another version, dropping them\n");
+        klog_park_drop(park);
+        return;
+    }
+    klog_adopt_hold(park, "parked by the previous load");
+}
+
+/**
+ * klog_persist_save() - Copy the buffers to reserved memory before a reboot
+ * @nb: klog_reboot_nb
+ * @action: SYS_RESTART, SYS_HALT or SYS_POWER_OFF
+ * @data: Command passed to reboot, unused
+ *
+ * Runs from the reboot notifiers, which kexec also calls before jumping to
+ * the new kernel. The region gets the same description of the channels as
+ * a handoff to klogger_park, followed by a copy of each segment. If the
+ * region is too small, the oldest segments of the largest channels are
+ * left out. Each channel is copied under its lock, so the copy is
+ * consistent with messages still being written.
+ *
+ * Return: NOTIFY_DONE
+ */
+static int klog_persist_save(struct notifier_block *nb, unsigned long action, void *data) {
+    struct klog_persist_hdr *hdr = klog.persist;
+    u32 skip[KLOG_MAX_CHANNELS] = {};
+    u32 live[KLOG_MAX_CHANNELS];
+    struct klog_park_channel *pch;
+    struct klog_park_meta *meta;
+    struct klog_channel *ch;
+    struct klog_seg *prev;
+    struct klog_seg *seg;
+    size_t blocks_off;
+    u32 nr_slots = 0;
+    u32 nr_blocks = 0;
+    u32 budget;
+    u32 most;
+    u32 keep;
+    char *blocks;
+    unsigned int i, j;
+
+    WRITE_ONCE(hdr->magic, 0);
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        spin_lock(&ch->lock);
+        live[i] = DIV_ROUND_UP(ch->head_seq - ch->first_seq, KLOG_SEG_ENTRIES);
+        spin_unlock(&ch->lock);
+        // Leave room for the segment opened meanwhile
+        live[i]++;
+        nr_slots += live[i];
+    }
+
+    meta = (struct klog_park_meta *)(hdr + 1);
+    blocks_off = ALIGN(sizeof(*hdr) + struct_size(meta, slots, nr_slots), SMP_CACHE_BYTES);
+    if (blocks_off >= persist_size) {
+        return NOTIFY_DONE;
+    }
+    blocks = (char *)hdr + blocks_off;
+    budget = (persist_size - blocks_off) / sizeof(struct klog_seg);
+
+    // Drop the oldest segments of the largest channels until the rest fits
+    while (nr_slots > budget) {
+        most = 0;
+        for (i = 1; i < klog.nr_channels; i++) {
+            if (live[i] - skip[i] > live[most] - skip[most]) {
+                most = i;
+            }
+        }
+        skip[most]++;
+        nr_slots--;
+    }
+
+    memset(meta, 0, sizeof(*meta));
+    meta->gseq = atomic64_read(&klog.gseq);
+    meta->seg_size = sizeof(struct klog_seg);
+    nr_slots = 0;
+    for (i = 0; i < klog.nr_channels; i++) {
+        ch = klog.channels[i];
+        spin_lock(&ch->lock);
+        keep = min_t(u64, DIV_ROUND_UP(ch->head_seq - ch->first_seq, KLOG_SEG_ENTRIES), live[i] - skip[i]);
+        if (!keep) {
+            spin_unlock(&ch->lock);
+            continue;
+        }
+        pch = &meta->channels[meta->nr_channels];
+        pch->first_seq = (klog_segno(ch->head_seq - 1) + 1 - keep) * KLOG_SEG_ENTRIES;
+        strscpy(pch->name, ch->name, sizeof(pch->name));
+        pch->head_seq = ch->head_seq;
+        pch->last_ts = ch->last_ts;
+        pch->weight_sum = ch->weight_sum;
+        pch->nr_slots = keep;
+        pch->slot = nr_slots;
+        memcpy(pch->writers, ch->writers, sizeof(pch->writers));
+
+        prev = NULL;
+        for (j = 0; j < pch->nr_slots; j++) {
+            seg = rcu_dereference_protected(*klog_seg_slot(ch, pch->first_seq + (u64)j * KLOG_SEG_ENTRIES),
+                                            lockdep_is_held(&ch->lock));
+            if (seg != prev) {
+                memcpy(blocks + (size_t)nr_blocks++ * sizeof(*seg), seg, sizeof(*seg));
+            }
+            meta->slots[nr_slots++] = nr_blocks - 1;
+            prev = seg;
+        }
+        spin_unlock(&ch->lock);
+        meta->nr_channels++;
+    }
+
+    hdr->version = KLOG_PARK_VERSION;
+    hdr->nr_blocks = nr_blocks;
+    hdr->meta_size = struct_size(meta, slots, nr_slots);
+    hdr->len = blocks_off - sizeof(*hdr) + (size_t)nr_blocks * sizeof(struct klog_seg);
+    hdr->crc = crc32_le(~0, (const u8 *)meta, hdr->meta_size) ^
+               crc32_le(~0, (const u8 *)blocks, (size_t)nr_blocks * sizeof(struct klog_seg));
+    smp_wmb();
+    WRITE_ONCE(hdr->magic, KLOG_PERSIST_MAGIC);
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block klog_reboot_nb = {
+    .notifier_call = klog_persist_save,
+};
+
+/**
+ * klog_persist_recount() - Redo the fair share accounting of a saved channel
+ * @pch: Saved state of the channel
+ * @park: Saved segments
+ *
+ * The oldest segments of a channel may have been left out of the save, so
+ * the counts are rebuilt from the messages that made it.
+ */
+static void klog_persist_recount(struct klog_park_channel *pch, struct klog_park *park) {
+    const struct klog_park_meta *meta = park->meta;
+    struct klog_seg *prev = NULL;
+    struct klog_seg *seg;
+    struct klog_hdr *hdr;
+    unsigned int i, j;
+
+    for (i = 0; i < KLOG_MAX_WRITERS; i++) {
+        pch->writers[i].count = 0;
+    }
+    pch->weight_sum = 0;
+
+    for (i = 0; i < pch->nr_slots; i++) {
+        seg = park->blocks[meta->slots[pch->slot + i]];
+        if (seg == prev) {
+            continue;
+        }
+        prev = seg;
+        for (j = 0; j < min_t(u32, seg->count, KLOG_SEG_ENTRIES); j++) {
+            hdr = &seg->hdr[j];
+            if (hdr->writer == KLOG_NO_WRITER) {
+                continue;
+            }
+            if (hdr->seq < pch->first_seq || hdr->seq >= pch->head_seq || hdr->writer >= KLOG_MAX_WRITERS) {
+                // Out of reach of klog_fair_release() from now on
+                hdr->writer = KLOG_NO_WRITER;
+                continue;
+            }
+            if (!pch->writers[hdr->writer].count++) {
+                pch->weight_sum += klog_writer_weight(&pch->writers[hdr->writer]);
+            }
+        }
+    }
+}
+
+/**
+ * klog_persist_load() - Rebuild the buffers saved before a kexec
+ * @hdr: Start of the reserved region
+ *
+ * The saved state is checked against the region bounds and its checksum,
+ * and the segments are copied out of the region into fresh ones.
+ *
+ * Return: Buffers in the form of a klogger_park handoff, or NULL
+ */
+static struct klog_park *klog_persist_load(struct klog_persist_hdr *hdr) {
+    struct klog_park_channel *pch;
+    struct klog_park_meta *meta;
+    struct klog_park *park;
+    struct klog_seg *seg;
+    size_t blocks_off;
+    size_t nr_slots;
+    const char *blocks;
+    unsigned int i, j;
+    u32 block;
+
+    if (hdr->version != KLOG_PARK_VERSION || hdr->meta_size < sizeof(*meta) ||
+        hdr->meta_size > persist_size - sizeof(*hdr)) {
+        return NULL;
+    }
+    meta = (struct klog_park_meta *)(hdr + 1);
+    blocks_off = ALIGN(sizeof(*hdr) + hdr->meta_size, SMP_CACHE_BYTES);
+    blocks = (const char *)hdr + blocks_off;
+    if (meta->seg_size != sizeof(struct klog_seg) || meta->nr_channels > KLOG_MAX_CHANNELS ||
+        blocks_off > persist_size ||
+        hdr->nr_blocks > (persist_size - blocks_off) / sizeof(struct klog_seg) ||
+        hdr->crc != (crc32_le(~0, (const u8 *)meta, hdr->meta_size) ^
+                     crc32_le(~0, (const u8 *)blocks, (size_t)hdr->nr_blocks * sizeof(struct klog_seg)))) {
+        return NULL;
+    }
+    nr_slots = (hdr->meta_size - sizeof(*meta)) / sizeof(meta->slots[0]);
+    for (i = 0; i < meta->nr_channels; i++) {
+        pch = &meta->channels[i];
+        if ((size_t)pch->slot + pch->nr_slots > nr_slots || !pch->nr_slots ||
+            pch->first_seq % KLOG_SEG_ENTRIES ||
+            DIV_ROUND_UP(pch->head_seq - pch->first_seq, KLOG_SEG_ENTRIES) != pch->nr_slots) {
+            return NULL;
+        }
+        for (j = 0; j < pch->nr_slots; j++) {
+            if (meta->slots[pch->slot + j] >= hdr->nr_blocks) {
+                return NULL;
+            }
+        }
+    }
+
+    park = kzalloc(sizeof(*park), GFP_KERNEL);
+    if (!park) {
+        return NULL;
+    }
+    park->version = KLOG_PARK_VERSION;
+    park->meta = kvmemdup(meta, hdr->meta_size, GFP_KERNEL);
+    park->blocks = kvcalloc(hdr->nr_blocks ?: 1, sizeof(*park->blocks), GFP_KERNEL);
+    if (!park->meta || !park->blocks) {
+        klog_park_drop(park);
+        return NULL;
+    }
+    meta = park->meta;
+
+    for (park->nr_blocks = 0; park->nr_blocks < hdr->nr_blocks; park->nr_blocks++) {
+        seg = klog_seg_alloc();
+        if (!seg) {
+            klog_park_drop(park);
+            return NULL;
+        }
+        // Everything but the reference count and the RCU head
+        memcpy(&seg->base, blocks + (size_t)park->nr_blocks * sizeof(*seg) + offsetof(struct klog_seg, base),
+               sizeof(*seg) - offsetof(struct klog_seg, base));
+        seg->span = 0;
+        park->blocks[park->nr_blocks] = seg;
+    }
+
+    // One reference per table entry, as when the segments were saved
+    for (i = 0; i < meta->nr_channels; i++) {
+        pch = &meta->channels[i];
+        for (j = 0; j < pch->nr_slots; j++) {
+            block = meta->slots[pch->slot + j];
+            seg = park->blocks[block];
+            if (seg->span++) {
+                kref_get(&seg->ref);
+            }
+        }
+        klog_persist_recount(pch, park);
+    }
+
+    return park;
+}
+
+/**
+ * klog_persist_take() - Take back the buffers the kernel before a kexec saved
+ *
+ * Maps the region given by persist_addr and persist_size and holds whatever
+ * the previous kernel saved there for the channels to adopt as they are
+ * created. The region is only claimed by klog_persist_init(), so a load that
+ * fails leaves the saved buffers for the next one. Failing to map the region
+ * is not fatal; the module then runs without it.
+ */
+static void klog_persist_take(void) {
+    struct klog_persist_hdr *hdr;
+    struct klog_park *park;
+
+    if (!persist_addr || !persist_size) {
+        return;
+    }
+    if (persist_size < sizeof(*hdr) + sizeof(struct klog_park_meta) + sizeof(struct klog_seg)) {
+        printk(KERN_WARNING "klogger: persist_size too small, not persisting\n");
+        return;
+    }
+    hdr = memremap(persist_addr, persist_size, MEMREMAP_WB);
+    if (!hdr) {
+        printk(KERN_WARNING "klogger: cannot map persist_addr, not persisting\n");
+        return;
+    }
+
+    if (READ_ONCE(hdr->magic) == KLOG_PERSIST_MAGIC) {
+        smp_rmb();
+        park = klog_persist_load(hdr);
+        if (park) {
+            klog_adopt_hold(park, "saved before the reboot");
+        } else {
+            printk(KERN_WARNING "klogger: buffers saved before the reboot are corrupt or from another version\n");
+        }
+    }
+
+    klog.persist = hdr;
+}
+
+/**
+ * klog_persist_init() - Keep the buffers in reserved memory across kexec
+ *
+ * Called once the load can no longer fail. Saves the buffers to the region
+ * mapped by klog_persist_take() on the next reboot.
+ */
+static void klog_persist_init(void) {
+    if (!klog.persist) {
+        return;
+    }
+
+    // Never adopt the same messages twice
+    WRITE_ONCE(klog.persist->magic, 0);
+    register_reboot_notifier(&klog_reboot_nb);
+}
+
+/**
+ * klog_persist_exit() - Stop keeping the buffers in reserved memory
+ *
+ * Also undoes klog_persist_take() on a failed load, the notifier then not
+ * being registered.
+ */
+static void klog_persist_exit(void) {
+    if (klog.persist) {
+        unregister_reboot_notifier(&klog_reboot_nb);
+        memunmap(klog.persist);
+        klog.persist = NULL;
+    }
+}
+
+/**
+ * klog_channels_destroy() - Destroy every channel, newest first
+ *
+ * No file can be using the channels any more.
+ */
+static void klog_channels_destroy(void) {
+    struct klog_group *grp, *tmp;
+    struct klog_channel *ch;
+
+    while (klog.nr_channels) {
+        ch = klog.channels[--klog.nr_channels];
+        klog.channels[ch->idx] = NULL;
+
+        remove_proc_entry(ch->name, klog.proc_dir);
+        device_destroy(klog.device_class, MKDEV(klog.major_number, ch->idx));
+
+        // Forget named consumers
+        list_for_each_entry_safe(grp, tmp, &ch->groups, node) {
+            klog_group_drop(ch, grp);
+        }
+
+        cancel_work_sync(&ch->compact_work);
+        klog_channel_free(ch);
+    }
+
+    debugfs_remove_recursive(klog.debugfs_dir);
+    klog.debugfs_dir = NULL;
+}
+
+/**
+ * klog_bpf_drain() - Write the messages staged by BPF programs on one CPU
+ * @work: Drain work of the stage
+ *
+ * Runs in process context, so the messages go through the backend of their
+ * channel like any other write. Messages the channel refuses, for example
+ * because a retaining consumer is behind, are dropped.
+ */
+static void klog_bpf_drain(struct work_struct *work) {
+    struct klog_bpf_stage *stage = container_of(work, struct klog_bpf_stage, work);
+    u32 head = smp_load_acquire(&stage->head);
+    struct klog_bpf_msg *m;
+    struct klog_channel *ch;
+    struct klog_hdr tmpl;
+    u32 tail;
+
+    for (tail = stage->tail; tail != head; tail++) {
+        m = &stage->msgs[tail % KLOG_BPF_STAGE];
+        ch = klog.channels[m->channel];
+        tmpl = (struct klog_hdr){
+            .ts_ns = m->ts_ns,
+            .level = klog_parse_level(m->text),
+            .writer = KLOG_NO_WRITER,
+            .pid = m->pid,
+        };
+        ch->backend->write(ch, NULL, m->text, m->len, &tmpl);
+        // Hand the slot back to bpf_klog_write()
+        smp_store_release(&stage->tail, tail + 1);
+    }
+}
+
+/**
+ * klog_bpf_kick() - Schedule the drain of a stage
+ * @work: irq_work of the stage
+ */
+static void klog_bpf_kick(struct irq_work *work) {
+    schedule_work(&container_of(work, struct klog_bpf_stage, irq_work)->work);
+}
+
+__bpf_kfunc_start_defs();
+
+/**
+ * bpf_klog_write() - Write a message to a channel from a BPF program
+ * @channel: Index of the channel, as in mux records
+ * @msg: Message text, optionally starting with a <N> level
+ * @msg__sz: Length of @msg in bytes
+ *
+ * Reserves a slot in the stage of the current CPU, copies the message in
+ * and commits it there; a worker then writes it to the channel, keeping
+ * the time of this call. Programs can therefore log from any context but
+ * NMI, without taking a channel lock. Messages from one CPU reach the
+ * channel in order. As with write(), only the last MSG_LEN - 1 bytes of a
+ * longer message are kept.
+ *
+ * Return: 0 on success, -EINVAL for a bad channel or an empty message,
+ * -EBUSY in NMI, -ENOSPC if the stage of this CPU is full
+ */
+__bpf_kfunc int bpf_klog_write(u32 channel, const void *msg, u32 msg__sz) {
+    struct klog_bpf_stage *stage;
+    struct klog_bpf_msg *m;
+    unsigned long flags;
+    u32 len = min_t(u32, msg__sz, MSG_LEN - 1);
+    int err = 0;
+
+    if (channel >= klog.nr_channels || !msg__sz) {
+        return -EINVAL;
+    }
+    if (in_nmi()) {
+        return -EBUSY;
+    }
+
+    // Keep interrupts, and the programs they run, off the slot being filled
+    local_irq_save(flags);
+    stage = &klog.bpf[smp_processor_id()];
+    if (stage->head - smp_load_acquire(&stage->tail) >= KLOG_BPF_STAGE) {
+        err = -ENOSPC;
+        goto out;
+    }
+    m = &stage->msgs[stage->head % KLOG_BPF_STAGE];
+    m->ts_ns = ktime_get_real_fast_ns();
+    m->channel = channel;
+    m->pid = task_tgid_nr(current);
+    m->len = len;
+    memcpy(m->text, msg + (msg__sz - len), len);
+    m->text[len] = '\0';
+    smp_store_release(&stage->head, stage->head + 1);
+    irq_work_queue(&stage->irq_work);
+out:
+    local_irq_restore(flags);
+    return err;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(klog_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_klog_write)
+BTF_KFUNCS_END(klog_kfunc_ids)
+
+static const struct btf_kfunc_id_set klog_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set = &klog_kfunc_ids,
+};
+
+/**
+ * klog_bpf_init() - Let tracing BPF programs write to the channels
+ *
+ * Allocates a stage per possible CPU and registers bpf_klog_write(). The
+ * kfunc is only found by the verifier on kernels built with module BTF.
+ * Failing is not fatal; the module then runs without it.
+ */
+static void klog_bpf_init(void) {
+    unsigned int cpu;
+    int err;
+
+    klog.bpf = kvcalloc(nr_cpu_ids, sizeof(*klog.bpf), GFP_KERNEL);
+    if (!klog.bpf) {
+        printk(KERN_WARNING "klogger: no memory for BPF stages, BPF writes disabled\n");
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        init_irq_work(&klog.bpf[cpu].irq_work, klog_bpf_kick);
+        INIT_WORK(&klog.bpf[cpu].work, klog_bpf_drain);
+    }
+
+    // A program using the kfunc holds a reference on the module until it is unloaded
+    err = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &klog_kfunc_set);
+    if (err) {
+        printk(KERN_WARNING "klogger: cannot register the BPF kfunc (%d), BPF writes disabled\n", err);
+        kvfree(klog.bpf);
+        klog.bpf = NULL;
+    }
+}
+
+/**
+ * klog_bpf_exit() - Drain what BPF programs left in the stages
+ *
+ * No program can still be using the kfunc once the module is unloading.
+ */
+static void klog_bpf_exit(void) {
+    unsigned int cpu;
+
+    if (!klog.bpf) {
+        return;
+    }
+    for_each_possible_cpu(cpu) {
+        irq_work_sync(&klog.bpf[cpu].irq_work);
+        flush_work(&klog.bpf[cpu].work);
+    }
+    kvfree(klog.bpf);
+    klog.bpf = NULL;
+}
+
+/**
+ * klogger_init() - Initialize the kernel logger module
+ *
+ * Creates the device class, the channels with their devices and /proc
+ * files, the mux device and klogfs.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int __init klogger_init(void) {
+    int err;
+
+    // klogfs file inodes keep the channel index in 4 bits
+    BUILD_BUG_ON(KLOG_MAX_CHANNELS > 16);
+    // Writer indexes are stored in 16 bits, and found by hashing
+    BUILD_BUG_ON(KLOG_MAX_WRITERS >= KLOG_MIXED_WRITER || !is_power_of_2(KLOG_MAX_WRITERS));
+    // Messages are located in a segment by masking their sequence number
+    BUILD_BUG_ON(!is_power_of_2(KLOG_SEG_ENTRIES));
+
+    if (fair_share > KLOG_FAIR_CGROUP) {
+        printk(KERN_ERR "klogger: invalid fair_share %u\n", fair_share);
+        return -EINVAL;
+    }
+    if (!is_power_of_2(burst) || burst > KLOG_MAX_BURST) {
+        printk(KERN_ERR "klogger: invalid burst %u\n", burst);
+        return -EINVAL;
+    }
+    atomic64_set(&klog.gseq, 0);
+
+    // Register major number
+    klog.major_number = register_chrdev(0, DEVICE_NAME, &fops);
+    if (klog.major_number < 0) {
+        printk(KERN_ERR "Failed to register major number\n");
+        return klog.major_number;
+    }
+
+    // Create device class
+    klog.device_class = class_create(CLASS_NAME);
+    if (IS_ERR(klog.device_class)) {
+        printk(KERN_ERR "Failed to create device class\n");
+        err = PTR_ERR(klog.device_class);
+        goto err_chrdev;
+    }
+
+    // Channels are listed in /proc/klogger
+    klog.proc_dir = proc_mkdir(PROC_DIR_NAME, NULL);
+    if (!klog.proc_dir) {
+        printk(KERN_ERR "Failed to create /proc/%s\n", PROC_DIR_NAME);
+        err = -ENOMEM;
+        goto err_class;
+    }
+
+    // Pick up where the previous load, or the kernel before a kexec, left off
+    klog_adopt();
+    klog_persist_take();
+
+    // Create the channels and their devices, which adopt those buffers
+    err = klog_channels_create();
+    klog_adopt_finish();
+    if (err) {
+        printk(KERN_ERR "Failed to create channels\n");
+        goto err_channels;
+    }
+
+    // Create the mux device
+    klog.mux_device = device_create(klog.device_class, NULL, MKDEV(klog.major_number, MUX_MINOR),
+                                    NULL, MUX_NAME);
+    if (IS_ERR(klog.mux_device)) {
+        printk(KERN_ERR "Failed to create %s\n", MUX_NAME);
+        err = PTR_ERR(klog.mux_device);
+        goto err_channels;
+    }
+
+    // Register klogfs
+    err = register_filesystem(&klogfs_type);
+    if (err) {
+        printk(KERN_ERR "Failed to register %s\n", KLOGFS_NAME);
+        goto err_mux;
+    }
+
+    // Let reclaim take segments back
+    klog_shrinker = shrinker_alloc(0, "klogger");
+    if (!klog_shrinker) {
+        printk(KERN_ERR "Failed to allocate the klogger shrinker\n");
+        err = -ENOMEM;
+        goto err_fs;
+    }
+    klog_shrinker->count_objects = klog_shrink_count;
+    klog_shrinker->scan_objects = klog_shrink_scan;
+    shrinker_register(klog_shrinker);
+
+    // Save the buffers to reserved memory on reboot, for the kernel after a kexec
+    klog_persist_init();
+
+    // Let tracing BPF programs write to the channels
+    klog_bpf_init();
+
+    // Start giving back the memory of idle channels and of past bursts
+    if (retire_ms || burst > 1) {
+        schedule_delayed_work(&klog_retire_work, msecs_to_jiffies(retire_ms ?: KLOG_SHRINK_MS));
+    }
+
+    printk(KERN_INFO "Klogger device registered with %u channel(s)\n", klog.nr_channels);
+    
+    return 0;
+
+err_fs:
+    unregister_filesystem(&klogfs_type);
+err_mux:
+    device_destroy(klog.device_class, MKDEV(klog.major_number, MUX_MINOR));
+err_channels:
+    // Leave whatever was adopted to the next load, as on unload
+    klog_persist_exit();
+    klog_park();
+    klog_channels_destroy();
+    proc_remove(klog.proc_dir);
+err_class:
+    class_destroy(klog.device_class);
+err_chrdev:
+    unregister_chrdev(klog.major_number, DEVICE_NAME);
+    return err;
+}
+
+/**
+ * klogger_exit() - Cleanup and unregister the kernel logger module
+ *
+ * Destroys the character devices, class, and frees resources.
+ * Warns if there are still open handles to the device.
+ */
+static void __exit klogger_exit(void) {
+    // if there are still handles open print a message
+    if (atomic_read(&klog.open_count) != 0) {
+        printk(KERN_WARNING "There are still %d device(s) open.\n", atomic_read(&klog.open_count));
+    }
+
+    // Write out what BPF programs left staged
+    klog_bpf_exit();
+
+    // Stop retiring and reclaiming segments before the channels go away
+    klog_persist_exit();
+    shrinker_free(klog_shrinker);
+    cancel_delayed_work_sync(&klog_retire_work);
+
+    // Unregister klogfs, it cannot be mounted while the module is in use
+    unregister_filesystem(&klogfs_type);
+
+    // Destroy the mux device
+    device_destroy(klog.device_class, MKDEV(klog.major_number, MUX_MINOR));
+
+    // Leave the buffers to the next load, then destroy the channels, their devices and /proc files
+    klog_park();
+    klog_channels_destroy();
 
-    // Destroy device
-    device_destroy(klog.device_class, MKDEV(klog.major_number, 0));
+    // Remove /proc/klogger
+    proc_remove(klog.proc_dir);
     
     // Destroy class
     class_destroy(klog.device_class);
@@ -0,0 +1,204 @@
+/*
+* klogger.h - User-space interface of the kernel logger
+*
+* Shared between the module and user-space programs that drive
+* /dev/klogger through ioctl().
+*/
+
+#ifndef _KLOGGER_H
+#define _KLOGGER_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define KLOG_IOC_MAGIC 'K'
+
+#define KLOG_GROUP_NAME_LEN 32   /* Maximum length of a consumer group name, with its NUL */
+#define KLOG_MAX_GROUPS 64       /* Maximum number of named consumers per channel */
+#define KLOG_MAX_CHANNELS 16     /* Maximum number of channels, the default one included */
+#define KLOG_CHANNEL_NAME_LEN 24 /* Maximum length of a channel name, with its NUL */
+#define KLOG_WEIGHT_DEFAULT 100  /* Weight of a writer that has not been given one */
+
+/* Values of the fair_share module parameter */
+#define KLOG_FAIR_OFF 0          /* A full buffer always overwrites its oldest message */
+#define KLOG_FAIR_TGID 1         /* The buffer is shared between processes by weight */
+#define KLOG_FAIR_CGROUP 2       /* The buffer is shared between cgroups by weight */
+
+/**
+ * struct klog_snapshot - Range of messages captured by KLOG_IOC_SNAPSHOT
+ * @first_seq: Sequence number of the oldest message in the snapshot
+ * @head_seq: Sequence number one past the newest message in the snapshot
+ */
+struct klog_snapshot {
+    __u64 first_seq;
+    __u64 head_seq;
+};
+
+/**
+ * struct klog_group_req - Consumer group to join with KLOG_IOC_GROUP_JOIN
+ * @name: NUL-terminated group name
+ */
+struct klog_group_req {
+    char name[KLOG_GROUP_NAME_LEN];
+};
+
+/**
+ * struct klog_offset - Named consumer position for the KLOG_IOC_OFFSET_* commands
+ * @name: NUL-terminated consumer name, the same namespace as consumer groups
+ * @seq: Sequence number of the next message the consumer will read
+ * @flags: KLOG_OFFSET_* flags
+ * @pad: Must be zero
+ */
+struct klog_offset {
+    char name[KLOG_GROUP_NAME_LEN];
+    __u64 seq;
+    __u32 flags;
+    __u32 pad;
+};
+
+/* Hold back writers rather than overwrite messages the consumer has not read */
+#define KLOG_OFFSET_RETAIN 0x1
+
+/**
+ * struct klog_notify - eventfd registration for KLOG_IOC_NOTIFY
+ * @fd: eventfd to signal, or -1 to unregister
+ * @watermark: Number of unread messages that triggers the eventfd
+ */
+struct klog_notify {
+    __s32 fd;
+    __u32 watermark;
+};
+
+/**
+ * struct klog_pressure - Pressure trigger for KLOG_IOC_PRESSURE
+ * @fill_pct: Fire when unread messages fill this percentage of the buffer, 0 to disable
+ * @pad: Must be zero
+ * @lag: Fire when at least this many messages are unread, 0 to disable
+ *
+ * Like PSI triggers, a crossing is reported once as POLLPRI by poll().
+ */
+struct klog_pressure {
+    __u32 fill_pct;
+    __u32 pad;
+    __u64 lag;
+};
+
+/**
+ * struct klog_weight - Writer weight for KLOG_IOC_WEIGHT
+ * @id: Process id or cgroup id of the writer, depending on fair_share; 0 for the caller
+ * @weight: Relative share of the buffer, 0 to go back to KLOG_WEIGHT_DEFAULT
+ * @pad: Must be zero
+ */
+struct klog_weight {
+    __u64 id;
+    __u32 weight;
+    __u32 pad;
+};
+
+/**
+ * struct klog_mux_sub - Channel to add or remove with the KLOG_IOC_MUX_* commands
+ * @name: NUL-terminated channel name, as in /proc/klogger
+ * @channel: Out: index of the channel, the tag of its records
+ * @pad: Must be zero
+ */
+struct klog_mux_sub {
+    char name[KLOG_CHANNEL_NAME_LEN];
+    __u32 channel;
+    __u32 pad;
+};
+
+/**
+ * struct klog_record - Header of a message read from the mux in record mode
+ * @gseq: Global sequence number of the message
+ * @seq: Sequence number of the message in its channel
+ * @ts_ns: Wall clock time of the write in ns
+ * @channel: Index of the channel the message was written to
+ * @len: Length of the message text following the header
+ * @level: Syslog severity of the message
+ * @pad: Zero
+ *
+ * The text is padded with zeros to a multiple of KLOG_RECORD_ALIGN, so the
+ * next header is aligned.
+ */
+struct klog_record {
+    __u64 gseq;
+    __u64 seq;
+    __u64 ts_ns;
+    __u32 channel;
+    __u16 len;
+    __u8 level;
+    __u8 pad;
+};
+
+#define KLOG_RECORD_ALIGN 8
+
+/**
+ * struct klog_purge - Messages to drop with KLOG_IOC_PURGE
+ * @flags: KLOG_PURGE_* flags; a message must match every criterion given
+ * @pid: Process id of the writer, in the initial pid namespace
+ * @tag: NUL-terminated prefix of the message text, after its <N> level
+ * @text: NUL-terminated string the message text must contain
+ * @purged: Out: number of messages purged
+ */
+struct klog_purge {
+    __u32 flags;
+    __s32 pid;
+    char tag[32];
+    char text[64];
+    __u64 purged;
+};
+
+#define KLOG_PURGE_PID 0x1
+#define KLOG_PURGE_TAG 0x2
+#define KLOG_PURGE_TEXT 0x4
+
+/**
+ * struct klog_import - Dump to restore with KLOG_IOC_IMPORT
+ * @buf: User space address of the dump, records as read from the mux in record mode
+ * @len: Length of the dump in bytes
+ * @channel: Channel index of the records to restore, others are skipped
+ * @pad: Must be zero
+ * @consumed: Out: bytes of the dump consumed, only whole records
+ * @imported: Out: number of messages restored
+ */
+struct klog_import {
+    __u64 buf;
+    __u64 len;
+    __u32 channel;
+    __u32 pad;
+    __u64 consumed;
+    __u64 imported;
+};
+
+/* Freeze the buffer for this file descriptor and rewind it to the oldest message */
+#define KLOG_IOC_SNAPSHOT _IOR(KLOG_IOC_MAGIC, 1, struct klog_snapshot)
+/* Drop the snapshot and go back to reading the live buffer */
+#define KLOG_IOC_SNAPSHOT_RELEASE _IO(KLOG_IOC_MAGIC, 2)
+/* Share one read position with every other member of a consumer group */
+#define KLOG_IOC_GROUP_JOIN _IOW(KLOG_IOC_MAGIC, 3, struct klog_group_req)
+/* Leave the consumer group and go back to a private read position */
+#define KLOG_IOC_GROUP_LEAVE _IO(KLOG_IOC_MAGIC, 4)
+/* Get the position and flags of a named consumer */
+#define KLOG_IOC_OFFSET_GET _IOWR(KLOG_IOC_MAGIC, 5, struct klog_offset)
+/* Set the position and flags of a named consumer, creating it if needed */
+#define KLOG_IOC_OFFSET_SET _IOW(KLOG_IOC_MAGIC, 6, struct klog_offset)
+/* Forget a named consumer */
+#define KLOG_IOC_OFFSET_DELETE _IOW(KLOG_IOC_MAGIC, 7, struct klog_offset)
+/* Signal an eventfd once this file has at least watermark unread messages */
+#define KLOG_IOC_NOTIFY _IOW(KLOG_IOC_MAGIC, 8, struct klog_notify)
+/* Report POLLPRI when this file's unread messages cross a threshold */
+#define KLOG_IOC_PRESSURE _IOW(KLOG_IOC_MAGIC, 9, struct klog_pressure)
+/* Read a channel through the mux; the first subscription drops all the others */
+#define KLOG_IOC_MUX_SUBSCRIBE _IOWR(KLOG_IOC_MAGIC, 10, struct klog_mux_sub)
+/* Stop reading a channel through the mux */
+#define KLOG_IOC_MUX_UNSUBSCRIBE _IOW(KLOG_IOC_MAGIC, 11, struct klog_mux_sub)
+/* Read struct klog_record headers, each followed by its message, from the mux */
+#define KLOG_IOC_MUX_RECORDS _IO(KLOG_IOC_MAGIC, 12)
+/* Set the weight of a writer of this channel in fair share mode */
+#define KLOG_IOC_WEIGHT _IOW(KLOG_IOC_MAGIC, 13, struct klog_weight)
+/* Drop every message of the channel that matches, and compact what is left */
+#define KLOG_IOC_PURGE _IOWR(KLOG_IOC_MAGIC, 14, struct klog_purge)
+/* Restore a dump of mux records into this channel at their sequence numbers */
+#define KLOG_IOC_IMPORT _IOWR(KLOG_IOC_MAGIC, 15, struct klog_import)
+
+#endif /* _KLOGGER_H */
@@ -0,0 +1,97 @@
+/*
+* klogger_park.c - Holder keeping klogger buffers across a module reload
+*
+* When loaded, klogger parks its segments here on unload instead of freeing
+* them, and the next klogger adopts them on load without copying. Nothing
+* depends on this module: klogger looks its symbols up at run time.
+*/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+
+#include "klogger_park.h"
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Lionel Silva");
+MODULE_DESCRIPTION("Kernel-space Logger buffer holder");
+MODULE_VERSION("0.1");
+
+static DEFINE_MUTEX(park_lock);
+static struct klog_park *parked;
+
+/**
+ * klog_park_free() - Free parked buffers
+ * @park: Buffers to free, may be NULL
+ */
+void klog_park_free(struct klog_park *park) {
+    unsigned int i;
+
+    if (!park) {
+        return;
+    }
+    for (i = 0; i < park->nr_blocks; i++) {
+        kvfree(park->blocks[i]);
+    }
+    kvfree(park->blocks);
+    kvfree(park->meta);
+    kfree(park);
+}
+EXPORT_SYMBOL_GPL(klog_park_free);
+
+/**
+ * klog_park_store() - Keep buffers until the next klogger takes them
+ * @park: Buffers of the klogger being unloaded, allocated with kmalloc()
+ *
+ * Takes ownership of @park. Buffers parked earlier and never taken are freed.
+ */
+void klog_park_store(struct klog_park *park) {
+    struct klog_park *old;
+
+    mutex_lock(&park_lock);
+    old = parked;
+    parked = park;
+    mutex_unlock(&park_lock);
+
+    klog_park_free(old);
+}
+EXPORT_SYMBOL_GPL(klog_park_store);
+
+/**
+ * klog_park_take() - Take back parked buffers
+ *
+ * Return: Buffers parked by the previous klogger, or NULL. The caller owns them.
+ */
+struct klog_park *klog_park_take(void) {
+    struct klog_park *park;
+
+    mutex_lock(&park_lock);
+    park = parked;
+    parked = NULL;
+    mutex_unlock(&park_lock);
+
+    return park;
+}
+EXPORT_SYMBOL_GPL(klog_park_take);
+
+/**
+ * klogger_park_init() - Initialize the holder
+ *
+ * Return: Always 0
+ */
+static int __init klogger_park_init(void) {
+    return 0;
+}
+
+/**
+ * klogger_park_exit() - Free whatever is still parked
+ */
+static void __exit klogger_park_exit(void) {
+    klog_park_free(parked);
+}
+
+module_init(klogger_park_init);
+module_exit(klogger_park_exit);
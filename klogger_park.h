@@ -0,0 +1,33 @@
+/*
+* klogger_park.h - Buffer handoff between two loads of the kernel logger
+*
+* Shared between klogger and klogger_park. The holder knows nothing of the
+* layout of what it keeps; klogger checks the version before adopting it.
+*/
+
+#ifndef _KLOGGER_PARK_H
+#define _KLOGGER_PARK_H
+
+#include <linux/types.h>
+
+/**
+ * struct klog_park - Buffers left behind by an unloaded klogger
+ * @version: Layout of @meta and of the blocks, as understood by klogger
+ * @meta: Description of the channels, allocated with kvmalloc()
+ * @nr_blocks: Number of entries in @blocks
+ * @blocks: Segments of the channels, each allocated with kvmalloc(), NULL once adopted
+ *
+ * Everything is freed with kvfree() if no klogger takes it back.
+ */
+struct klog_park {
+    u32 version;
+    void *meta;
+    unsigned int nr_blocks;
+    void **blocks;
+};
+
+void klog_park_store(struct klog_park *park);
+struct klog_park *klog_park_take(void);
+void klog_park_free(struct klog_park *park);
+
+#endif /* _KLOGGER_PARK_H */
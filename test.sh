@@ -78,6 +78,75 @@ EXPECTED=$'msg1\nmsg2\nmsg3\nmsg4\nmsg5'
 [ "$READ_RESULT" = "$EXPECTED" ]
 assert $? "Multiple message read" "$EXPECTED" "$READ_RESULT"
 
+READ_RESULT=$(cat /proc/klogger/klogger)
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Read through /proc" "$EXPECTED" "$READ_RESULT"
+
+# Vectored read test
+print_header "Vectored read test"
+make reload > /dev/null
+for i in {1..3}; do
+    echo "vec$i" > /dev/klogger
+done
+READ_RESULT=$(python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_RDONLY)
+bufs = [bytearray(64) for _ in range(4)]
+used = os.readv(fd, bufs) // 64
+print(used, *[b.split(b"\0")[0].decode().strip() for b in bufs[:used]])
+')
+EXPECTED="3 vec1 vec2 vec3"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "One message per iovec" "$EXPECTED" "$READ_RESULT"
+
+# An empty iovec must not swallow a message
+READ_RESULT=$(python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_RDONLY)
+bufs = [bytearray(64), bytearray(0), bytearray(64)]
+os.readv(fd, bufs)
+print(*[b.split(b"\0")[0].decode().strip() for b in bufs if b])
+')
+EXPECTED="vec1 vec2"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Empty iovec skipped" "$EXPECTED" "$READ_RESULT"
+
+# A single iovec cannot be told apart from read() and packs messages
+READ_RESULT=$(python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_RDONLY)
+buf = bytearray(64)
+n = os.readv(fd, [buf])
+print(buf[:n].decode(), end="")
+')
+EXPECTED=$'vec1\nvec2\nvec3'
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Single iovec reads like read()" "$EXPECTED" "$READ_RESULT"
+
+# Positional read test
+READ_RESULT=$(python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_RDONLY)
+print(os.pread(fd, 4096, 1).decode(), end="")
+')
+EXPECTED=$'vec2\nvec3'
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "pread by sequence number" "$EXPECTED" "$READ_RESULT"
+
+# Snapshot test
+print_header "Snapshot test"
+READ_RESULT=$(python3 -c '
+import fcntl, os, struct
+KLOG_IOC_SNAPSHOT = 0x80104b01
+fd = os.open("/dev/klogger", os.O_RDWR)
+first, head = struct.unpack("QQ", fcntl.ioctl(fd, KLOG_IOC_SNAPSHOT, bytes(16)))
+os.write(fd, b"after_snapshot\n")
+print(first, head, os.read(fd, 4096).decode(), end="")
+')
+EXPECTED=$'0 3 vec1\nvec2\nvec3'
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Snapshot ignores later writes" "$EXPECTED" "$READ_RESULT"
+
 # Buffer overflow test
 print_header "Buffer overflow test"
 make reload > /dev/null
@@ -89,6 +158,408 @@ EXPECTED=$'overflow1025\noverflow1026\noverflow1027\noverflow1028'
 [ "$READ_RESULT" = "$EXPECTED" ]
 assert $? "Buffer overflow handling" "$EXPECTED" "$READ_RESULT"
 
+READ_RESULT=$(python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_RDONLY)
+os.lseek(fd, -4, os.SEEK_END)
+print(os.read(fd, 4096).decode(), end="")
+')
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Seek to newest messages" "$EXPECTED" "$READ_RESULT"
+
+# Consumer group test
+print_header "Consumer group test"
+make reload > /dev/null
+for i in {1..4}; do
+    echo "g$i" > /dev/klogger
+done
+READ_RESULT=$(python3 -c '
+import fcntl, os
+KLOG_IOC_GROUP_JOIN = 0x40204b03
+def member(group):
+    fd = os.open("/dev/klogger", os.O_RDONLY | os.O_NONBLOCK)
+    fcntl.ioctl(fd, KLOG_IOC_GROUP_JOIN, group.ljust(32, b"\0"))
+    return fd
+a, b, other = member(b"shippers"), member(b"shippers"), member(b"archive")
+split = [os.read(fd, 4).decode().strip() for fd in (a, b, a, b)]
+print(*split, *os.read(other, 4096).decode().split())
+')
+EXPECTED="g1 g2 g3 g4 g1 g2 g3 g4"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Groups split messages, each group sees all" "$EXPECTED" "$READ_RESULT"
+
+READ_RESULT=$(python3 -c '
+import fcntl, os, struct
+KLOG_IOC_GROUP_JOIN = 0x40204b03
+KLOG_IOC_OFFSET_GET = 0xc0304b05
+KLOG_IOC_OFFSET_SET = 0x40304b06
+def offset(name, seq=0):
+    return struct.pack("32sQII", name, seq, 0, 0)
+fd = os.open("/dev/klogger", os.O_RDONLY | os.O_NONBLOCK)
+fcntl.ioctl(fd, KLOG_IOC_OFFSET_SET, offset(b"restarted", 2))
+fcntl.ioctl(fd, KLOG_IOC_GROUP_JOIN, b"restarted".ljust(32, b"\0"))
+got = os.read(fd, 4096).decode().split()
+os.close(fd)
+fd = os.open("/dev/klogger", os.O_RDONLY)
+saved = struct.unpack("32sQII", fcntl.ioctl(fd, KLOG_IOC_OFFSET_GET, offset(b"restarted")))[1]
+print(*got, saved)
+')
+EXPECTED="g3 g4 4"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Named offset survives its reader" "$EXPECTED" "$READ_RESULT"
+
+# eventfd test
+READ_RESULT=$(python3 -c '
+import fcntl, os, struct
+KLOG_IOC_NOTIFY = 0x40084b08
+efd = os.eventfd(0, os.EFD_NONBLOCK)
+fd = os.open("/dev/klogger", os.O_RDWR)
+os.lseek(fd, 0, os.SEEK_END)
+fcntl.ioctl(fd, KLOG_IOC_NOTIFY, struct.pack("iI", efd, 2))
+os.write(fd, b"n1\n")
+try:
+    early = os.eventfd_read(efd)
+except BlockingIOError:
+    early = 0
+for msg in (b"n2\n", b"n3\n"):
+    os.write(fd, msg)
+print(early, os.eventfd_read(efd))
+')
+EXPECTED="0 1"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "eventfd signalled once at the watermark" "$EXPECTED" "$READ_RESULT"
+
+# Pressure trigger test
+READ_RESULT=$(python3 -c '
+import fcntl, os, select, struct
+KLOG_IOC_PRESSURE = 0x40104b09
+fd = os.open("/dev/klogger", os.O_RDWR)
+os.lseek(fd, 0, os.SEEK_END)
+fcntl.ioctl(fd, KLOG_IOC_PRESSURE, struct.pack("IIQ", 0, 0, 3))
+p = select.poll()
+p.register(fd, select.POLLPRI)
+def pressure():
+    return int(any(ev & select.POLLPRI for _, ev in p.poll(0)))
+before = pressure()
+for i in range(3):
+    os.write(fd, b"p%d\n" % i)
+print(before, pressure(), pressure())
+')
+EXPECTED="0 1 0"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Pressure event reported once" "$EXPECTED" "$READ_RESULT"
+
+# klogfs test
+print_header "klogfs test"
+make reload > /dev/null
+echo "<3>disk failed" > /dev/klogger
+echo "all good" > /dev/klogger
+KLOGFS_DIR=$(mktemp -d)
+sudo mount -t klogfs none "$KLOGFS_DIR"
+READ_RESULT=$(cat "$KLOGFS_DIR/klogger/errors")
+EXPECTED="<3>disk failed"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "klogfs errors file" "$EXPECTED" "$READ_RESULT"
+
+READ_RESULT=$(cat "$KLOGFS_DIR"/klogger/????-??-??T??:?? | tail -1)
+EXPECTED="all good"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "klogfs minute slices" "$EXPECTED" "$READ_RESULT"
+
+# stat() reports the length read() returns, for rsync
+READ_RESULT=$(stat -c %s "$KLOGFS_DIR/klogger/latest")
+EXPECTED=$(cat "$KLOGFS_DIR/klogger/latest" | wc -c)
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "klogfs file size" "$EXPECTED" "$READ_RESULT"
+sudo umount "$KLOGFS_DIR"
+rmdir "$KLOGFS_DIR"
+
+# Global order test
+print_header "Global order test"
+make unload > /dev/null
+make load CHANNELS=app,db > /dev/null
+echo "one" > /dev/klogger-app
+echo "two" > /dev/klogger
+echo "three" > /dev/klogger-db
+echo "four" > /dev/klogger-app
+READ_RESULT=$(cat /dev/klogger-app | tr '\n' ' ')
+EXPECTED="one four "
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Channels are separate" "$EXPECTED" "$READ_RESULT"
+
+READ_RESULT=$(cat /dev/klogger-mux | tr '\n' ' ')
+EXPECTED="one two three four "
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Mux merges channels in write order" "$EXPECTED" "$READ_RESULT"
+
+READ_RESULT=$(python3 -c '
+import fcntl, os, select, struct
+fd = os.open("/dev/klogger-mux", os.O_RDONLY)
+sub = bytearray(struct.pack("24sII", b"db", 0, 0))
+fcntl.ioctl(fd, 0xc0204b0a, sub)    # KLOG_IOC_MUX_SUBSCRIBE
+fcntl.ioctl(fd, 0x4b0c)             # KLOG_IOC_MUX_RECORDS
+p = select.poll()
+p.register(fd, select.POLLIN)
+ready = bool(p.poll(0))
+data = os.read(fd, 4096)
+gseq, seq, ts, channel, length, level, pad = struct.unpack_from("QQQIHBB", data)
+print(ready, channel == struct.unpack("24sII", sub)[1], len(data), data[32:32 + length].decode().strip())
+')
+EXPECTED="True True 40 three"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Mux subscription with tagged records" "$EXPECTED" "$READ_RESULT"
+
+# Channel quota test
+print_header "Channel quota test"
+make unload > /dev/null
+make load CHANNELS=small:128K > /dev/null
+python3 -c '
+import os
+fd = os.open("/dev/klogger-small", os.O_WRONLY)
+for i in range(512):
+    os.write(fd, b"quota %d\n" % i)
+'
+READ_RESULT=$(cat /dev/klogger-small | wc -l)
+EXPECTED="512"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Channel buffer sized by its quota" "$EXPECTED" "$READ_RESULT"
+
+# The next message starts a third segment and evicts the first one whole
+echo "quota 512" > /dev/klogger-small
+READ_RESULT=$(cat /dev/klogger-small | head -n 1):$(cat /dev/klogger-small | wc -l)
+EXPECTED="quota 256:257"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Oldest segment evicted whole" "$EXPECTED" "$READ_RESULT"
+
+# Burst test
+print_header "Burst test"
+make unload > /dev/null
+make load CHANNELS=burst:128K > /dev/null
+OFFSET='
+import fcntl, os, struct, sys
+KLOG_IOC_OFFSET_SET = 0x40304b06
+fd = os.open("/dev/klogger-burst", os.O_WRONLY)
+seq, count = int(sys.argv[1]), int(sys.argv[2])
+fcntl.ioctl(fd, KLOG_IOC_OFFSET_SET, struct.pack("32sQII", b"shipper", seq, 0, 0))
+for i in range(count):
+    os.write(fd, b"burst %d\n" % (seq + i))
+'
+python3 -c "$OFFSET" 0 1024
+READ_RESULT=$(cat /dev/klogger-burst | wc -l)
+EXPECTED="1024"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Buffer grows while a consumer is behind" "$EXPECTED" "$READ_RESULT"
+
+# Once the consumer has caught up the oldest segment is evicted again
+python3 -c "$OFFSET" 1024 1
+READ_RESULT=$(cat /dev/klogger-burst | wc -l)
+EXPECTED="769"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Eviction resumes once consumers catch up" "$EXPECTED" "$READ_RESULT"
+
+# Fair sharing test
+print_header "Fair sharing test"
+make unload > /dev/null
+make load FAIR_SHARE=1 > /dev/null
+WRITER='
+import errno, os, sys
+fd = os.open("/dev/klogger", os.O_WRONLY)
+for i in range(int(sys.argv[2])):
+    try:
+        os.write(fd, b"%s %d\n" % (sys.argv[1].encode(), i))
+    except OSError as e:
+        if e.errno != errno.ENOBUFS:
+            raise
+'
+python3 -c "$WRITER" noisy 1100
+echo "quiet writer" > /dev/klogger
+python3 -c "$WRITER" noisy 1100
+READ_RESULT=$(cat /dev/klogger | grep -c "quiet writer")
+EXPECTED="1"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Other writers keep their messages" "$EXPECTED" "$READ_RESULT"
+
+# Two writers of equal weight end up with about half the buffer each,
+# however much more one of them writes
+make unload > /dev/null
+make load FAIR_SHARE=1 > /dev/null
+python3 -c "$WRITER" heavy 2048
+python3 -c "$WRITER" light 512
+python3 -c "$WRITER" heavy 2048
+HEAVY=$(cat /dev/klogger | grep -c "^heavy")
+LIGHT=$(cat /dev/klogger | grep -c "^light")
+SHARE=$((HEAVY * 100 / (HEAVY + LIGHT)))
+[ "$SHARE" -ge 35 ] && [ "$SHARE" -le 65 ]
+assert $? "Heavy writer held to its share" "35-65%" "$SHARE% ($HEAVY heavy, $LIGHT light)"
+
+# Purge test
+print_header "Purge test"
+make reload > /dev/null
+python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_WRONLY)
+for i in range(600):
+    os.write(fd, b"<6>secret %d\n" % i if i % 2 else b"keep %d\n" % i)
+'
+PURGED=$(sudo python3 -c '
+import fcntl, os, struct
+KLOG_IOC_PURGE = 0xc0704b0e
+KLOG_PURGE_TAG = 0x2
+fd = os.open("/dev/klogger", os.O_RDONLY)
+req = fcntl.ioctl(fd, KLOG_IOC_PURGE, struct.pack("Ii32s64sQ", KLOG_PURGE_TAG, 0, b"secret", b"", 0))
+print(struct.unpack("Ii32s64sQ", req)[4])
+')
+READ_RESULT=$PURGED:$(cat /dev/klogger | grep -c "secret"):$(cat /dev/klogger | grep -c "keep")
+EXPECTED="300:0:300"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Matching messages purged" "$EXPECTED" "$READ_RESULT"
+
+# Compaction gives the purged room back: the buffer holds 1024 messages,
+# half of them purged, so 512 more fit without evicting any kept one
+make reload > /dev/null
+python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_WRONLY)
+for i in range(1024):
+    os.write(fd, b"<6>secret %d\n" % i if i % 2 else b"keep %d\n" % i)
+'
+sudo python3 -c '
+import fcntl, os, struct
+fd = os.open("/dev/klogger", os.O_RDONLY)
+fcntl.ioctl(fd, 0xc0704b0e, struct.pack("Ii32s64sQ", 0x2, 0, b"secret", b"", 0))
+'
+sleep 1
+for i in {1..512}; do
+    echo "new $i"
+done > /dev/klogger
+READ_RESULT=$(cat /dev/klogger | grep -c "keep"):$(cat /dev/klogger | grep -c "new")
+EXPECTED="512:512"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Compaction makes room for new messages" "$EXPECTED" "$READ_RESULT"
+
+# The same without room to grow: history packed by compaction still spans
+# more than the quota
+make unload > /dev/null
+make load BURST=1 > /dev/null
+python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_WRONLY)
+for i in range(1024):
+    os.write(fd, b"<6>secret %d\n" % i if i % 2 else b"keep %d\n" % i)
+'
+sudo python3 -c '
+import fcntl, os, struct
+fd = os.open("/dev/klogger", os.O_RDONLY)
+fcntl.ioctl(fd, 0xc0704b0e, struct.pack("Ii32s64sQ", 0x2, 0, b"secret", b"", 0))
+'
+sleep 1
+for i in {1..512}; do
+    echo "new $i"
+done > /dev/klogger
+READ_RESULT=$(cat /dev/klogger | grep -c "keep"):$(cat /dev/klogger | grep -c "new")
+EXPECTED="512:512"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Compaction makes room without burst" "$EXPECTED" "$READ_RESULT"
+make unload > /dev/null
+make load > /dev/null
+
+# Import test
+print_header "Import test"
+make reload > /dev/null
+python3 -c '
+import os
+fd = os.open("/dev/klogger", os.O_WRONLY)
+for i in range(300):
+    os.write(fd, b"saved %d\n" % i)
+'
+DUMP=$(mktemp)
+python3 -c '
+import fcntl, os, sys
+fd = os.open("/dev/klogger-mux", os.O_RDONLY)
+fcntl.ioctl(fd, 0x4b0c)             # KLOG_IOC_MUX_RECORDS
+with open(sys.argv[1], "wb") as f:
+    while True:
+        data = os.read(fd, 65536)
+        if not data:
+            break
+        f.write(data)
+' "$DUMP"
+make reload > /dev/null
+READ_RESULT=$(sudo python3 -c '
+import ctypes, fcntl, os, struct, sys
+KLOG_IOC_IMPORT = 0xc0284b0f
+dump = ctypes.create_string_buffer(open(sys.argv[1], "rb").read())
+fd = os.open("/dev/klogger", os.O_RDONLY)
+req = fcntl.ioctl(fd, KLOG_IOC_IMPORT, struct.pack("QQIIQQ", ctypes.addressof(dump), len(dump.raw) - 1, 0, 0, 0, 0))
+print(struct.unpack("QQIIQQ", req)[5], os.lseek(fd, 0, os.SEEK_END))
+' "$DUMP"):$(cat /dev/klogger | head -n 1)
+rm -f "$DUMP"
+EXPECTED="300 300:saved 0"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Dump restored at its sequence numbers" "$EXPECTED" "$READ_RESULT"
+
+# Whole segments missing from a dump are skipped, not filled in one by one
+make reload > /dev/null
+READ_RESULT=$(sudo python3 -c '
+import ctypes, fcntl, os, struct
+def record(seq, text):
+    text += b"\0" * (-len(text) % 8)
+    return struct.pack("QQQIHBB", seq, seq, 0, 0, len(text.rstrip(b"\0")), 6, 0) + text
+raw = record(10, b"before gap\n") + record(3000, b"after gap\n")
+dump = ctypes.create_string_buffer(raw)
+fd = os.open("/dev/klogger", os.O_RDONLY)
+req = fcntl.ioctl(fd, 0xc0284b0f, struct.pack("QQIIQQ", ctypes.addressof(dump), len(raw), 0, 0, 0, 0))
+print(struct.unpack("QQIIQQ", req)[5], os.lseek(fd, 0, os.SEEK_END))
+'):$(cat /dev/klogger | tr '\n' ' ')
+EXPECTED="2 3001:before gap after gap "
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Gap in a dump skipped" "$EXPECTED" "$READ_RESULT"
+
+# Relay channel test
+print_header "Relay channel test"
+make unload > /dev/null
+make load CHANNELS=r::relay > /dev/null
+for i in {1..3}; do
+    echo "relay$i" | taskset -c 0 tee /dev/klogger-r > /dev/null
+done
+READ_RESULT=$(sudo python3 -c '
+import struct
+data = open("/sys/kernel/debug/klogger/r0", "rb").read()
+texts = []
+while len(data) >= 32:
+    seq, length = struct.unpack_from("Q", data, 8)[0], struct.unpack_from("H", data, 28)[0]
+    texts.append("%d:%s" % (seq, data[32:32 + length].decode().strip()))
+    data = data[32 + (length + 7) // 8 * 8:]
+print(*texts)
+')
+EXPECTED="0:relay1 1:relay2 2:relay3"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Relay records read from debugfs" "$EXPECTED" "$READ_RESULT"
+
+# Trace channel test
+print_header "Trace channel test"
+make unload > /dev/null
+make load CHANNELS=t::trace > /dev/null
+LAST_CPU=$(($(nproc) - 1))
+for i in {1..6}; do
+    echo "trace$i" | taskset -c $(( i % 2 ? 0 : LAST_CPU )) tee /dev/klogger-t > /dev/null
+done
+READ_RESULT=$(cat /dev/klogger-t | tr '\n' ' '):$(cat /dev/klogger-t | wc -c)
+EXPECTED="trace1 trace2 trace3 trace4 trace5 trace6 :0"
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Trace channel merged in write order and consumed" "$EXPECTED" "$READ_RESULT"
+
+# Upgrade test
+print_header "Upgrade test"
+make reload > /dev/null
+echo "before upgrade" > /dev/klogger
+make upgrade > /dev/null
+echo "after upgrade" > /dev/klogger
+READ_RESULT=$(cat /dev/klogger | tr '\n' ' ')
+EXPECTED="before upgrade after upgrade "
+[ "$READ_RESULT" = "$EXPECTED" ]
+assert $? "Messages kept across an upgrade" "$EXPECTED" "$READ_RESULT"
+
 # Concurrent access test
 print_header "Concurrent access test"
 make reload > /dev/null